@@ -6,27 +6,42 @@
 
 #include "ipspatch.h"
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <errno.h>
+
+// x86 SIMD compare kernels are built with per-function target attributes,
+// so no special compiler flags are needed and the program still runs on older CPUs.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// progress messages on stdout (off in batch workers)
+int verbose = 1;
 
 // File Operations
 // Open a file from the filesystem
 FILE *openFile(const char *filename) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
-        printf("%s [%s]\n", "Error opening file:", filename);
+        LOG("%s [%s]\n", "Error opening file:", filename);
         return NULL;
     }
 
-    printf("%s [%s]\n", "Opened File:", filename);
+    LOG("%s [%s]\n", "Opened File:", filename);
     return file;
 }
 
 // close a file descriptor
 void closeFile(FILE *fileDescriptor) {
   if (fileDescriptor) {
-    printf("%s [0x%X]\n", "Closing file...", fileDescriptor);
+    LOG("%s [0x%X]\n", "Closing file...", fileDescriptor);
     fclose(fileDescriptor);
   } else {
-    printf("%s\n", "File Descriptor does not point to and open file. Ignoring.");
+    LOG("%s\n", "File Descriptor does not point to and open file. Ignoring.");
   }
 }
 
@@ -43,10 +58,13 @@ int checkValidPatch(FILE *ipsDescriptor) {
   // compare header with MAGIC BLOCK
   if (memcmp(magic_bytes, IPS_MAGIC_TAG, IPS_MAGIC_SIZE) == 0) {
     // file is vaild
-    printf("[SANITY CHECK] %s\n", "checkValidPatch(): Magic Bytes Match: Patch is VALID.");
+    LOG("[SANITY CHECK] %s\n", "checkValidPatch(): Magic Bytes Match: Patch is VALID.");
+    return 1;
+  } else if (memcmp(magic_bytes, IPSC_MAGIC_TAG, IPSC_MAGIC_SIZE) == 0) {
+    LOG("[SANITY CHECK] %s\n", "checkValidPatch(): Compiled Patch Detected.");
     return 1;
   } else {
-    printf("[SANITY CHECK] %s\n", "checkValidPatch(): Magic Bytes Mismatch: Patch is INVALID.");
+    LOG("[SANITY CHECK] %s\n", "checkValidPatch(): Magic Bytes Mismatch: Patch is INVALID.");
     return 0;
   }
 }
@@ -54,7 +72,7 @@ int checkValidPatch(FILE *ipsDescriptor) {
 // Check block for the EOF Tag
 int checkEof(uint8_t *mem_offset) {
   if (memcmp(mem_offset, IPS_END_TAG, IPS_END_SIZE) == 0) {
-    printf("[SANITY CHECK]: %s\n", "checkEof(): Reached EOF of IPS Patch File.");
+    LOG("[SANITY CHECK]: %s\n", "checkEof(): Reached EOF of IPS Patch File.");
     return 1; // eof reached
   } else {
     return 0; // still more to read
@@ -62,370 +80,2553 @@ int checkEof(uint8_t *mem_offset) {
 }
 
 // MEMORY STRUCTURE FOR PATCHES
-// Count patch items currently placed in the linked list
-uint count(recordEntry *head) {
-  uint c = 0;
-  recordEntry *current = head;
-  while (current) {
-    c++; current = current->next;
+// allocate an empty patch set, with a payload arena of arenaSize bytes.
+// the arena is sized once (from the patch file size) and never moves.
+patchSet *newPatchSet(size_t arenaSize) {
+  patchSet *set = (patchSet *)calloc(1, sizeof(struct IPS_PATCH_SET));
+  if (!set) return NULL;
+
+  if (arenaSize > 0) {
+    set->arena = (uint8_t *)malloc(arenaSize);
+    if (!set->arena) {
+      free(set);
+      return NULL;
+    }
+    set->arenaSize = arenaSize;
   }
-  return c;
+  set->payload = set->arena;
+  return set;
 }
 
-// return the pointer to the last patch entry in the linked list
-recordEntry *last(recordEntry *first) {
-  recordEntry *current = first;
-  while (current) {
-    if (current->next == NULL) { return current;}
-    current=current->next;
-  }
-  return NULL;
+// Count patch items currently stored in the patch set
+uint count(patchSet *set) {
+  return (set) ? set->count : 0;
 }
 
-// allocate a new Patch Item from memory
-recordEntry *new() {
-  // allocate memory for a record
-  recordEntry *temp = (recordEntry *)malloc(sizeof(struct IPS_PATCH_RECORD));
-  // ok memory allocated, set up the initial item contents
-  if (temp) {
-    temp->next = NULL;
-    temp->r = NULL;
-    temp->patchValue = NULL;
-    return temp;
+// reserve a new record at the end of the record array (amortized O(1))
+recordEntry *appendItem(patchSet *set) {
+  recordEntry *records;
+  uint32_t capacity;
+
+  if (set->count == set->capacity) {
+    capacity = (set->capacity == 0) ? IPS_INITIAL_RECORDS : set->capacity * 2;
+    records = (recordEntry *)realloc(set->records, capacity * sizeof(struct IPS_PATCH_RECORD));
+    if (!records) return NULL;
+    set->records = records;
+    set->capacity = capacity;
   }
-  // error during allocation, return NULL
-  return NULL;
+
+  records = &set->records[set->count];
+  memset(records, 0, sizeof(struct IPS_PATCH_RECORD));
+  records->seq = set->count++;
+  return records;
 }
 
-// append a new Patch Item to the linked list
-void appendItem(recordEntry **first, recordEntry *newEntry) {
-  // base case, insert first element
-  if (*first == NULL) {
-    *first = newEntry;
-  } else if ((*first)->next == NULL) {
-    // enqueue first item to a non-null head
-    (*first)->next = newEntry;
-  } else {
-    // generic case, append after the last element
-    last(*first)->next = newEntry;
+// reserve payload bytes in the arena
+uint8_t *arenaAlloc(patchSet *set, size_t size, uint32_t *position) {
+  if (set->arenaUsed + size > set->arenaSize) return NULL;
+  *position = (uint32_t)set->arenaUsed;
+  set->arenaUsed += size;
+  return set->arena + *position;
+}
+
+// order records by offset, records at the same offset keep the file order
+int compareRecords(const void *a, const void *b) {
+  const recordEntry *ra = (const recordEntry *)a;
+  const recordEntry *rb = (const recordEntry *)b;
+
+  if (ra->offset != rb->offset) return (ra->offset < rb->offset) ? -1 : 1;
+  if (ra->seq != rb->seq) return (ra->seq < rb->seq) ? -1 : 1;
+  return 0;
+}
+
+// sort records by offset (most patches are already sorted: nothing to do then)
+// and look for overlapping records: IPS is last-writer-wins, so when records overlap
+// they must still be applied in file order, which is kept in fileOrder.
+int sortRecords(patchSet *set) {
+  uint32_t i, end = 0;
+  uint8_t sorted = 1, overlapping = 0;
+
+  for (i = 1; (i < set->count) && sorted; i++) {
+    if (compareRecords(&set->records[i - 1], &set->records[i]) > 0) sorted = 0;
+  }
+  if (!sorted) qsort(set->records, set->count, sizeof(struct IPS_PATCH_RECORD), compareRecords);
+
+  for (i = 0; i < set->count; i++) {
+    if (set->records[i].offset < end) overlapping = 1;
+    if (set->records[i].offset + set->records[i].size > end) end = set->records[i].offset + set->records[i].size;
   }
+  set->maxEnd = end;
+
+  if (overlapping) {
+    set->fileOrder = (uint32_t *)malloc(set->count * sizeof(uint32_t));
+    if (!set->fileOrder) return 0;
+    for (i = 0; i < set->count; i++) set->fileOrder[set->records[i].seq] = i;
+  }
+  return 1;
+}
+
+// i-th record in application order (file order when records overlap, offset order otherwise)
+recordEntry *recordAt(patchSet *set, uint32_t i) {
+  return (set->fileOrder) ? &set->records[set->fileOrder[i]] : &set->records[i];
 }
 
 // -debug function-
-// Dump the contents of the linked list to stdout
-void dump(recordEntry *first) {
-  recordEntry *current = first;
-  while (current) {
+// Dump the contents of the patch set to stdout
+void dump(patchSet *set) {
+  recordEntry *current;
+
+  for (uint32_t r = 0; r < count(set); r++) {
+    current = &set->records[r];
     // is this entry rle encoded?
-    if (current->patchValue == NULL) {
+    if (current->rle) {
       printf("%s\n", "-------------------------------");
-      printf("ROM OFFSET: 0x%X\tPATCH SIZE IN BYTES: 0x%X\tBYTE VALUE: %d\tRLE ENCODING: %s\n", LINEAR_24(current->r->offset), LINEAR_16(current->rle.length), current->rle.byte_val, "YES");
+      printf("ROM OFFSET: 0x%X\tPATCH SIZE IN BYTES: 0x%X\tBYTE VALUE: %d\tRLE ENCODING: %s\n", current->offset, current->size, current->byte_val, "YES");
       printf("%s\n", "-------------------------------");
     } else {
-      printf("ROM OFFSET: 0x%X\tPATCH SIZE IN BYTES: 0x%X\tRLE ENCODING: %s\n", LINEAR_24(current->r->offset), LINEAR_16(current->r->size), "NO");
-      for (unsigned int i = 0; i < (LINEAR_16(current->r->size)); i++) {
-        printf("0x%X ", current->patchValue[i]);
+      printf("ROM OFFSET: 0x%X\tPATCH SIZE IN BYTES: 0x%X\tRLE ENCODING: %s\n", current->offset, current->size, "NO");
+      for (unsigned int i = 0; i < current->size; i++) {
+        printf("0x%X ", RECORD_DATA(set, current)[i]);
         if ((i % 16) == 0) {
           printf("\n");
         }
       }
       printf("%s\n", "-------------------------------");
     }
-    current = current->next;
   }
 }
 
 // deallocate the patch structure
-void destroy(recordEntry *head) {
-  // no-op, no items in the linked list
-  if (head == NULL) return;
+void destroy(patchSet *set) {
+  if (set == NULL) return;
 
-  // deallocate current node
-  if (head->next == NULL) {
-    // deallocate
-    if (head->r) free(head->r);
-    if (head->patchValue) free (head->patchValue);
-    return;
-  } else destroy(head->next); // recursively advance until the last element
+  if (set->records && !set->compiled) free(set->records);
+  if (set->fileOrder) free(set->fileOrder);
+  if (set->arena) free(set->arena);
+  if (set->mapping) munmap(set->mapping, set->mappingSize);
+  free(set);
 }
 
 // PATCH FILE MANAGEMENT FUNCTIONS
-// load patches from an IPS file descriptor
-recordEntry *loadIpsPatch(FILE *patchFile) {
-  // patch record entries
-  recordEntry *patchHead = NULL;
-  // pointer to the last entry in the patch list
+// build the record index of an IPS patch held in memory.
+// payloads are not copied: records point into data, which must outlive the patch set.
+// every field is bounds checked, a truncated patch is rejected.
+patchSet *parseIpsPatch(const uint8_t *data, size_t size) {
+  patchSet *set = NULL;
   recordEntry *latestEntry = NULL;
-  // record header
-  recordHeader *patchRecord = NULL;
-
-  // rewind descriptor: start from the beginning of the file
-  fseek(patchFile, 0L, SEEK_SET);
-  // seek past the IPS magic tag
-  fseek(patchFile, IPS_MAGIC_SIZE, SEEK_CUR);
-
-  // read first patch record header
-  patchRecord = (recordHeader *)malloc(sizeof(union IPS_RECORD_HEADER));
-  fread(patchRecord, sizeof(union IPS_RECORD_HEADER), 1, patchFile);
-
-  // loop over patches, stop at EOF
-  while (!checkEof(patchRecord->offset)) {
-    // read & insert patch into the linked list
-    latestEntry = new();
-    if (latestEntry) {
-      latestEntry->r = patchRecord;
-    } else {
-      if (patchRecord) free(patchRecord);
-      destroy(patchHead);
-      return NULL;
+  const recordHeader *patchRecord;
+  const rleHeader *rleRecord;
+  size_t position = IPS_MAGIC_SIZE;
+
+  if ((size < IPS_MAGIC_SIZE) || (memcmp(data, IPS_MAGIC_TAG, IPS_MAGIC_SIZE) != 0)) return NULL;
+  set = newPatchSet(0);
+  if (!set) return NULL;
+  set->payload = data;
+
+  // loop over patches, stop at EOF (the EOF tag is shorter than a record header)
+  while (position + IPS_END_SIZE <= size) {
+    if (memcmp(data + position, IPS_END_TAG, IPS_END_SIZE) == 0) {
+      position += IPS_END_SIZE;
+      // truncation extension: new ROM size after the EOF tag
+      if (position + 3 <= size) {
+        set->truncate = 1;
+        set->truncateSize = LINEAR_24((data + position));
+      }
+      if (!sortRecords(set)) break;
+      return set;
     }
+    if (position + sizeof(union IPS_RECORD_HEADER) > size) break;
+
+    latestEntry = appendItem(set);
+    if (!latestEntry) break;
+    patchRecord = (const recordHeader *)(data + position);
+    position += sizeof(union IPS_RECORD_HEADER);
+    latestEntry->offset = LINEAR_24(patchRecord->offset);
+    latestEntry->size = LINEAR_16(patchRecord->size);
 
-    // Read Patch Record contents from file
-    uint16_t size = LINEAR_16(latestEntry->r->size);
     // Patch Record RLE Encoded....
-    if (size == 0) {
-      // load data into this entry
-      fread(&(latestEntry->rle.length), 2, 1, patchFile);
-      // read rle byte
-      fread(&(latestEntry->rle.byte_val), 1, 1, patchFile);
-      // set patchvalue to null
-      latestEntry->patchValue = NULL;
-    } else { // patch record is BYTEPATCH
-      // load data into the entry
-      latestEntry->patchValue = (uint8_t *)malloc(LINEAR_16(latestEntry->r->size));
-      if (latestEntry->patchValue) {
-        fread(latestEntry->patchValue, LINEAR_16(latestEntry->r->size), 1, patchFile);
-      } else {
-        if (patchRecord) free(patchRecord);
-        destroy(patchHead);
-        return NULL;
-      }
+    if (latestEntry->size == 0) {
+      if (position + sizeof(struct IPS_RLE_RECORD) > size) break;
+      rleRecord = (const rleHeader *)(data + position);
+      position += sizeof(struct IPS_RLE_RECORD);
+      latestEntry->rle = 1;
+      latestEntry->size = LINEAR_16(rleRecord->length);
+      latestEntry->byte_val = rleRecord->byte_val;
+    } else { // patch record is BYTEPATCH: payload stays in place
+      if (position + latestEntry->size > size) break;
+      latestEntry->data = (uint32_t)position;
+      position += latestEntry->size;
     }
+  }
+
+  // truncated patch or out of memory
+  destroy(set);
+  return NULL;
+}
 
-    // append entry in the linked list
-    appendItem(&patchHead, latestEntry);
+// CRC-32 (IEEE), table driven. the table is built once, from any thread
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
 
-    // move to the next record
-    patchRecord = (recordHeader *)malloc(sizeof(union IPS_RECORD_HEADER));
-    fread(patchRecord, sizeof(union IPS_RECORD_HEADER), 1, patchFile);
+void buildCrcTable(void) {
+  uint32_t crc;
+  int i, bit;
+
+  for (i = 0; i < 256; i++) {
+    crc = (uint32_t)i;
+    for (bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+    crcTable[i] = crc;
   }
+}
 
-  // return pointer to the patch list
-  printf("[INFO]: File Contains %d unique byte patches\n", count(patchHead));
-  return patchHead;
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t size) {
+  pthread_once(&crcTableOnce, buildCrcTable);
+  crc = ~crc;
+  while (size--) crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
 }
 
-// checks whether a patch set is already applied to a ROM image
-uint8_t patchApplied(FILE *romFile, recordEntry *patches) {
-  // patch selector pointer
-  recordEntry *currentPatch = patches;
-  // rom bytes to be matched against patch
-  uint8_t *rom_data = NULL;
-
-  // verify that all patches are applied to the rom file
-  for (unsigned int i=0; i<count(patches); i++) {
-    // seek to the correct offset
-    fseek(romFile, 0L, SEEK_SET); fseek(romFile, LINEAR_24(currentPatch->r->offset), SEEK_CUR);
-    // compare patch bytes
-    if (currentPatch->patchValue == NULL) {
-      // patch is RLE, read data from rom
-      rom_data = (uint8_t *)malloc(LINEAR_16(currentPatch->rle.length));
-      if (!rom_data) {
-        printf("%s\n", "Out of Memory.");
-        return 0;
-      }
-      fread(rom_data, LINEAR_16(currentPatch->rle.length), 1, romFile);
-      for (unsigned int j=0; j<(LINEAR_16(currentPatch->rle.length)); j++) {
-        if (rom_data[j] != currentPatch->rle.byte_val) {
-          printf("[VERIFY] Byte Mismatch @offset: 0x%X\n", LINEAR_24(currentPatch->r->offset));
-          if (rom_data) free(rom_data); rom_data = NULL;
-          return 0;
-        }
-      }
-      free(rom_data); rom_data = NULL;
-    } else {
-      // compare bytes, read data from rom
-      rom_data = (uint8_t *)malloc(LINEAR_16(currentPatch->r->size));
-      if (!rom_data) {
-        printf("%s\n", "Out of Memory.");
-        return 0;
-      }
-      fread(rom_data, LINEAR_16(currentPatch->r->size), 1, romFile);
-      if (memcmp(rom_data, currentPatch->patchValue, LINEAR_16(currentPatch->r->size)) != 0) {
-        printf("[VERIFY] Byte Mismatch @offset: 0x%X\n", LINEAR_24(currentPatch->r->offset));
-        if (rom_data) free(rom_data); rom_data = NULL;
-        return 0;
-      }
-      free(rom_data); rom_data = NULL;
-    }
-    // advance next patch
-    if (rom_data) free(rom_data);
-    currentPatch = currentPatch->next;
+// checksum of a compiled patch: header (checksum field zeroed) and record array
+uint32_t compiledChecksum(const compiledHeader *header, const recordEntry *records) {
+  compiledHeader copy = *header;
+
+  copy.checksum = 0;
+  return crc32Update(crc32Update(0, (const uint8_t *)&copy, sizeof(copy)),
+                     (const uint8_t *)records, (size_t)header->recordCount * sizeof(struct IPS_PATCH_RECORD));
+}
+
+// checksum the record array of a compiled patch and check every record in the same pass:
+// non empty, sorted without overlaps, inside maxEnd and (literal records) inside the payload.
+// returns 0 when a record does not fit, whatever the checksum says
+int checkCompiledRecords(const compiledHeader *header, const recordEntry *records, uint32_t *checksum) {
+  compiledHeader copy = *header;
+  uint64_t end, previousEnd = 0;
+  uint32_t i;
+
+  copy.checksum = 0;
+  *checksum = crc32Update(0, (const uint8_t *)&copy, sizeof(copy));
+  for (i = 0; i < header->recordCount; i++) {
+    *checksum = crc32Update(*checksum, (const uint8_t *)&records[i], sizeof(struct IPS_PATCH_RECORD));
+    end = (uint64_t)records[i].offset + records[i].size;
+    if ((records[i].size == 0) || (records[i].offset < previousEnd) || (end > header->maxEnd)) return 0;
+    if (!records[i].rle && ((uint64_t)records[i].data + records[i].size > header->payloadSize)) return 0;
+    previousEnd = end;
+  }
+  return 1;
+}
+
+// use a compiled patch held in memory: records and payloads are used in place, the header
+// is checked (bounds, byte order, version) and the index checksummed and bounds checked
+patchSet *parseCompiledPatch(const uint8_t *data, size_t size) {
+  const compiledHeader *header = (const compiledHeader *)data;
+  patchSet *set;
+  uint32_t checksum;
+
+  if ((size < sizeof(struct IPS_COMPILED_HEADER)) || (memcmp(header->magic, IPSC_MAGIC_TAG, IPSC_MAGIC_SIZE) != 0)) return NULL;
+  if ((header->byteOrder != IPSC_BYTE_ORDER) || (header->version != IPSC_VERSION)) return NULL;
+  if ((header->recordsOffset % 8 != 0) || (header->recordsOffset > size) ||
+      ((size - header->recordsOffset) / sizeof(struct IPS_PATCH_RECORD) < header->recordCount)) return NULL;
+  if ((header->payloadOffset > size) || (size - header->payloadOffset < header->payloadSize)) return NULL;
+  if (!checkCompiledRecords(header, (const recordEntry *)(data + header->recordsOffset), &checksum) ||
+      (checksum != header->checksum)) return NULL;
+
+  set = (patchSet *)calloc(1, sizeof(struct IPS_PATCH_SET));
+  if (!set) return NULL;
+  set->records = (recordEntry *)(data + header->recordsOffset);
+  set->count = header->recordCount;
+  set->capacity = header->recordCount;
+  set->maxEnd = header->maxEnd;
+  set->truncate = (header->flags & IPSC_TRUNCATE) ? 1 : 0;
+  set->truncateSize = header->truncateSize;
+  set->payload = data + header->payloadOffset;
+  set->compiled = 1;
+  return set;
+}
+
+// compile mode: save a normalized patch set as a compiled patch, payloads packed in record order
+int writeCompiledPatch(patchSet *set, const char *patchName) {
+  compiledHeader header;
+  recordEntry *records;
+  FILE *out;
+  uint64_t payloadSize = 0;
+  uint32_t i;
+  int ok;
+
+  if (set->fileOrder) return 0;
+  records = (recordEntry *)malloc(((size_t)count(set) + 1) * sizeof(struct IPS_PATCH_RECORD));
+  if (!records) return 0;
+  for (i = 0; i < count(set); i++) {
+    records[i] = set->records[i];
+    records[i].seq = i;
+    records[i].data = 0;
+    if (records[i].rle) continue;
+    records[i].data = (uint32_t)payloadSize;
+    payloadSize += records[i].size;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IPSC_MAGIC_TAG, IPSC_MAGIC_SIZE);
+  header.version = IPSC_VERSION;
+  header.byteOrder = IPSC_BYTE_ORDER;
+  header.recordCount = count(set);
+  header.flags = set->truncate ? IPSC_TRUNCATE : 0;
+  header.maxEnd = set->maxEnd;
+  header.truncateSize = set->truncateSize;
+  header.recordsOffset = sizeof(struct IPS_COMPILED_HEADER);
+  header.payloadOffset = header.recordsOffset + (uint64_t)count(set) * sizeof(struct IPS_PATCH_RECORD);
+  header.payloadSize = payloadSize;
+  header.checksum = compiledChecksum(&header, records);
+
+  out = fopen(patchName, "w");
+  if (!out) {
+    free(records);
+    return 0;
+  }
+  ok = (fwrite(&header, sizeof(header), 1, out) == 1);
+  if (ok && count(set)) ok = (fwrite(records, sizeof(struct IPS_PATCH_RECORD), count(set), out) == count(set));
+  for (i = 0; ok && (i < count(set)); i++) {
+    if (set->records[i].rle) continue;
+    ok = (fwrite(RECORD_DATA(set, &set->records[i]), set->records[i].size, 1, out) == 1);
+  }
+  if (fclose(out) != 0) ok = 0;
+  free(records);
+  return ok;
+}
+
+// load patches from an IPS file descriptor
+// the file is memory mapped and indexed in place: one mapping and one record
+// array, whatever the number of records. Compiled patches are used as mapped
+patchSet *loadIpsPatch(FILE *patchFile) {
+  patchSet *set = NULL;
+  struct stat fileStats;
+  void *mapping;
+
+  if ((fstat(fileno(patchFile), &fileStats) != 0) || (fileStats.st_size < (off_t)IPS_MAGIC_SIZE)) return NULL;
+  mapping = mmap(NULL, fileStats.st_size, PROT_READ, MAP_PRIVATE, fileno(patchFile), 0);
+  if (mapping == MAP_FAILED) return NULL;
+  madvise(mapping, fileStats.st_size, MADV_SEQUENTIAL);
+
+  if ((fileStats.st_size >= IPSC_MAGIC_SIZE) && (memcmp(mapping, IPSC_MAGIC_TAG, IPSC_MAGIC_SIZE) == 0)) {
+    set = parseCompiledPatch((const uint8_t *)mapping, fileStats.st_size);
+  } else {
+    set = parseIpsPatch((const uint8_t *)mapping, fileStats.st_size);
+  }
+  if (!set) {
+    munmap(mapping, fileStats.st_size);
+    return NULL;
+  }
+  set->mapping = mapping;
+  set->mappingSize = fileStats.st_size;
+  return set;
+}
+
+// load an IPS patch file without any message (NULL when it cannot be opened or parsed)
+patchSet *readPatchFile(const char *patchFileName) {
+  patchSet *set;
+  FILE *patchFile;
+
+  patchFile = fopen(patchFileName, "r");
+  if (!patchFile) return NULL;
+  set = loadIpsPatch(patchFile);
+  fclose(patchFile);
+  return set;
+}
+
+// ROM IMAGES
+// deallocate a ROM image
+void freeRom(romImage *rom) {
+  if (rom == NULL) return;
+  if (rom->mapped) {
+    if (rom->data) munmap(rom->data - rom->base, rom->base + rom->capacity);
+  } else if (rom->data) {
+    free(rom->data - rom->base);
+  }
+  free(rom);
+}
+
+// copier header size of a ROM file, (size_t)-1 when a forced header does not fit
+size_t romHeader(int fd, int headerMode) {
+  struct stat fileStats;
+  size_t header;
+
+  if ((headerMode == HEADER_OFF) || (fstat(fd, &fileStats) != 0)) return 0;
+  if (headerMode == HEADER_ON) {
+    if ((size_t)fileStats.st_size < IPS_HEADER_SIZE) return (size_t)-1;
+    LOG("[HEADER] Copier header (%d bytes): records are applied after it.\n", IPS_HEADER_SIZE);
+    return IPS_HEADER_SIZE;
+  }
+  // only a 512-byte remainder is a copier header: other remainders (NES headers, CD
+  // sectors, grown or odd sized ROMs) are raw images patched at their file offsets
+  header = ((size_t)fileStats.st_size % 1024 == IPS_HEADER_SIZE) ? IPS_HEADER_SIZE : 0;
+  if (header) LOG("[HEADER] Headered Rom Detected (%zu bytes): records are applied after the header.\n", header);
+  return header;
+}
+
+// map a whole ROM file read-only (images that are only read, never patched),
+// base bytes of copier header are skipped
+romImage *mapRom(FILE *romFile, size_t base) {
+  romImage *rom = NULL;
+  struct stat fileStats;
+  void *mapping;
+
+  if ((fstat(fileno(romFile), &fileStats) != 0) || (fileStats.st_size == 0) || ((size_t)fileStats.st_size < base)) return NULL;
+  mapping = mmap(NULL, fileStats.st_size, PROT_READ, MAP_PRIVATE, fileno(romFile), 0);
+  if (mapping == MAP_FAILED) return NULL;
+  madvise(mapping, fileStats.st_size, MADV_SEQUENTIAL);
+
+  rom = (romImage *)calloc(1, sizeof(struct ROM_IMAGE));
+  if (!rom) {
+    munmap(mapping, fileStats.st_size);
+    return NULL;
+  }
+  rom->data = (uint8_t *)mapping + base;
+  rom->base = base;
+  rom->size = fileStats.st_size - base;
+  rom->capacity = rom->size;
+  rom->fd = -1;
+  rom->mapped = 1;
+  return rom;
+}
+
+// load a whole ROM file in memory with a single read, reserving room for
+// 'reserve' bytes (the end of the furthest patch record). The copier header
+// (base bytes) is read along, in front of the image
+romImage *loadRom(FILE *romFile, size_t reserve, size_t base) {
+  romImage *rom = NULL;
+  struct stat fileStats;
+  uint8_t *buffer;
+
+  if ((fstat(fileno(romFile), &fileStats) != 0) || ((size_t)fileStats.st_size < base)) return NULL;
+
+  rom = (romImage *)calloc(1, sizeof(struct ROM_IMAGE));
+  if (!rom) return NULL;
+  rom->fd = -1;
+  rom->base = base;
+  rom->size = fileStats.st_size - base;
+  rom->capacity = (reserve > rom->size) ? reserve : rom->size;
+  buffer = (uint8_t *)malloc((base + rom->capacity > 0) ? base + rom->capacity : 1);
+  if (!buffer) {
+    free(rom);
+    return NULL;
   }
+  rom->data = buffer + base;
 
-  printf("%s\n", "[VERIFY]: Patch Applied OK or ROM Already Patched.");
+  rewind(romFile);
+  if ((fileStats.st_size > 0) && (fread(buffer, fileStats.st_size, 1, romFile) != 1)) {
+    freeRom(rom);
+    return NULL;
+  }
+  return rom;
+}
+
+// extend the image to 'size' bytes, new bytes are zeroed
+int growRom(romImage *rom, size_t size) {
+  uint8_t *data;
+
+  if (size <= rom->size) return 1;
+  if (size > rom->capacity) {
+    data = (uint8_t *)realloc(rom->data - rom->base, rom->base + size);
+    if (!data) return 0;
+    rom->data = data + rom->base;
+    rom->capacity = size;
+  }
+  memset(rom->data + rom->size, 0, size - rom->size);
+  rom->size = size;
   return 1;
 }
 
-// duplicate files
-FILE *dupeFile(FILE *source, unsigned char *destName) {
-  FILE *destination = NULL;
-  uint8_t chunk;
+// wrap an open ROM file: records are read and written in place, after base bytes of header
+romImage *fileRom(int fd, size_t base) {
+  romImage *rom = NULL;
+  struct stat fileStats;
+
+  if ((fstat(fd, &fileStats) != 0) || ((size_t)fileStats.st_size < base)) return NULL;
+  rom = (romImage *)calloc(1, sizeof(struct ROM_IMAGE));
+  if (!rom) return NULL;
+  rom->fd = fd;
+  rom->base = base;
+  rom->size = fileStats.st_size - base;
+  rom->capacity = rom->size;
+  return rom;
+}
 
-  // descriptor info
+// map an open ROM file for writing, records are then written straight to the page cache.
+// the file is extended up front to hold 'reserve' bytes (the end of the furthest record)
+romImage *mapRomShared(int fd, size_t base, size_t reserve) {
+  romImage *rom = NULL;
   struct stat fileStats;
-  unsigned long headerSize = 0L;
-  if (fstat(fileno(source), &fileStats) == 0) {
-      headerSize = fileStats.st_size % 1024; // is the rom headered?
-      if (headerSize != 0) { printf("%s\n", "Headered Rom Detected");}
-  }
-
-  if (destName) {
-    destination = fopen((const char *)destName, "w");
-    rewind(source);
-    for (unsigned int i=0; i<fileStats.st_size; i++) {
-      fread(&chunk, sizeof(uint8_t), 1, source);
-      fwrite(&chunk, sizeof(uint8_t), 1, destination);
-    }
-    fflush(destination);
-    rewind(destination);
-    return destination;
-  }
-  else return NULL;
-}
-
-// apply patches to a rom file.
-FILE *applyPatch(FILE *destRom, recordEntry *patches) {
-  // pointer to the last unapplied patch data
-  recordEntry *current = patches;
-
-  // loop over available patches
-  for (unsigned int i=0; i<count(patches); i++) {
-    // update offset
-    fseek(destRom, 0L, SEEK_SET); fseek(destRom, LINEAR_24(current->r->offset), SEEK_CUR);
-    // apply patch
-    if (current->patchValue == NULL) { // patch is RLE Encoded
-      // patch bytes
-      for (unsigned int r=0; r<(LINEAR_16(current->rle.length)); r++) {
-        fwrite(&current->rle.byte_val, sizeof(uint8_t), 1, destRom);
-      }
+  size_t size, mappingSize;
+  void *mapping;
+
+  if ((fstat(fd, &fileStats) != 0) || ((size_t)fileStats.st_size < base)) return NULL;
+  size = fileStats.st_size - base;
+  mappingSize = base + ((reserve > size) ? reserve : size);
+  if (mappingSize == 0) return NULL;
+  if ((mappingSize > (size_t)fileStats.st_size) && (ftruncate(fd, mappingSize) != 0)) return NULL;
+  mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) return NULL;
+
+  rom = (romImage *)calloc(1, sizeof(struct ROM_IMAGE));
+  if (!rom) {
+    munmap(mapping, mappingSize);
+    return NULL;
+  }
+  rom->data = (uint8_t *)mapping + base;
+  rom->base = base;
+  rom->size = size;
+  rom->capacity = mappingSize - base;
+  rom->fd = fd;
+  rom->mapped = 1;
+  return rom;
+}
+
+// full pread/pwrite, retrying on short transfers
+int preadAll(int fd, uint8_t *buffer, size_t size, off_t offset) {
+  ssize_t chunk;
+
+  while (size > 0) {
+    chunk = pread(fd, buffer, size, offset);
+    if (chunk < 0 && errno == EINTR) continue;
+    if (chunk <= 0) return 0;
+    buffer += chunk; size -= chunk; offset += chunk;
+  }
+  return 1;
+}
+
+int pwriteAll(int fd, const uint8_t *buffer, size_t size, off_t offset) {
+  ssize_t chunk;
+
+  while (size > 0) {
+    chunk = pwrite(fd, buffer, size, offset);
+    if (chunk < 0 && errno == EINTR) continue;
+    if (chunk <= 0) return 0;
+    buffer += chunk; size -= chunk; offset += chunk;
+  }
+  return 1;
+}
+
+// bytes of the image under [offset, offset + size): a pointer into memory images,
+// a pread into scratch (at least IPS_MAX_RECORD_SIZE bytes) for file backed ones.
+// NULL if the range goes past the end of the image
+const uint8_t *romBytes(romImage *rom, size_t offset, size_t size, uint8_t *scratch) {
+  if (offset + size > rom->size) return NULL;
+  if (rom->data) return rom->data + offset;
+  if (!preadAll(rom->fd, scratch, size, rom->base + offset)) return NULL;
+  return scratch;
+}
+
+// FAST DESTINATION CLONING
+// copy a file from 'offset' inside the kernel: reflink first (the copy shares the source
+// extents on btrfs/XFS, no data is copied), then copy_file_range, then sendfile.
+// whole files only can be reflinked (a 512-byte header is not block aligned).
+// returns the name of the method used, NULL on failure
+const char *cloneFile(int sourceFd, int destFd, size_t offset, size_t size) {
+  off_t sourceOffset = offset;
+  size_t copied = 0;
+  ssize_t chunk;
+
+#ifdef FICLONE
+  if ((offset == 0) && (ioctl(destFd, FICLONE, sourceFd) == 0)) return "reflink";
+#endif
+  while (copied < size) {
+    chunk = copy_file_range(sourceFd, &sourceOffset, destFd, NULL, size - copied, 0);
+    if (chunk <= 0) break;
+    copied += chunk;
+  }
+  if (copied == size) return "copy_file_range";
+
+  // sendfile carries on from where copy_file_range stopped
+  while (copied < size) {
+    chunk = sendfile(destFd, sourceFd, &sourceOffset, size - copied);
+    if (chunk <= 0) return NULL;
+    copied += chunk;
+  }
+  return "sendfile";
+}
+
+// write the whole image (and the copier header, unless stripped) with a single call
+int writeRom(romImage *rom, const char *destName, int stripHeader) {
+  FILE *destination = NULL;
+  const uint8_t *start = stripHeader ? rom->data : rom->data - rom->base;
+  size_t size = stripHeader ? rom->size : rom->base + rom->size, written = 0;
+
+  destination = fopen(destName, "w");
+  if (!destination) return 0;
+  if (size > 0) written = fwrite(start, size, 1, destination);
+  if ((fclose(destination) != 0) || ((size > 0) && (written != 1))) return 0;
+  return 1;
+}
+
+// COMPARE KERNELS
+// portable kernels
+size_t matchLengthScalar(const uint8_t *a, const uint8_t *b, size_t n) {
+  size_t i = 0;
+  while ((i < n) && (a[i] == b[i])) i++;
+  return i;
+}
+
+size_t runLengthScalar(const uint8_t *a, uint8_t value, size_t n) {
+  size_t i = 0;
+  while ((i < n) && (a[i] == value)) i++;
+  return i;
+}
+
+#ifdef IPS_X86_KERNELS
+// SSE2 kernels: 16 bytes per compare, the first mismatch is found from the movemask
+__attribute__((target("sse2")))
+size_t matchLengthSse2(const uint8_t *a, const uint8_t *b, size_t n) {
+  size_t i;
+  unsigned int mask;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+    if (mask != 0xFFFF) return i + __builtin_ctz(~mask);
+  }
+  return i + matchLengthScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+size_t runLengthSse2(const uint8_t *a, uint8_t value, size_t n) {
+  const __m128i run = _mm_set1_epi8((char)value);
+  size_t i;
+  unsigned int mask;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), run));
+    if (mask != 0xFFFF) return i + __builtin_ctz(~mask);
+  }
+  return i + runLengthScalar(a + i, value, n - i);
+}
+
+// AVX2 kernels: 32 bytes per compare
+__attribute__((target("avx2")))
+size_t matchLengthAvx2(const uint8_t *a, const uint8_t *b, size_t n) {
+  size_t i;
+  unsigned int mask;
+
+  for (i = 0; i + 32 <= n; i += 32) {
+    mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i))));
+    if (mask != 0xFFFFFFFF) return i + __builtin_ctz(~mask);
+  }
+  return i + matchLengthSse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t runLengthAvx2(const uint8_t *a, uint8_t value, size_t n) {
+  const __m256i run = _mm256_set1_epi8((char)value);
+  size_t i;
+  unsigned int mask;
+
+  for (i = 0; i + 32 <= n; i += 32) {
+    mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), run));
+    if (mask != 0xFFFFFFFF) return i + __builtin_ctz(~mask);
+  }
+  return i + runLengthSse2(a + i, value, n - i);
+}
+#endif
+
+// available kernels, fastest first
+compareKernel compareKernels[] = {
+#ifdef IPS_X86_KERNELS
+  { "avx2", matchLengthAvx2, runLengthAvx2 },
+  { "sse2", matchLengthSse2, runLengthSse2 },
+#endif
+  { "scalar", matchLengthScalar, runLengthScalar },
+};
+
+// pick the fastest kernel supported by this CPU (no state, safe from any thread)
+compareKernel *selectCompareKernel(void) {
+#ifdef IPS_X86_KERNELS
+  if (__builtin_cpu_supports("avx2")) return &compareKernels[0];
+  if (__builtin_cpu_supports("sse2")) return &compareKernels[1];
+#endif
+  return &compareKernels[sizeof(compareKernels) / sizeof(compareKernels[0]) - 1];
+}
+
+// VERIFICATION
+// are the record bytes already in the ROM image? (file backed images are read in
+// chunks of IPS_MAX_RECORD_SIZE bytes into scratch, merged records can be bigger)
+uint8_t recordMatches(romImage *rom, patchSet *patches, recordEntry *currentPatch, compareKernel *kernel, uint8_t *scratch) {
+  const uint8_t *rom_data;
+  uint32_t done = 0, chunk;
+
+  while (done < currentPatch->size) {
+    chunk = currentPatch->size - done;
+    if ((rom->data == NULL) && (chunk > IPS_MAX_RECORD_SIZE)) chunk = IPS_MAX_RECORD_SIZE;
+    rom_data = romBytes(rom, (size_t)currentPatch->offset + done, chunk, scratch);
+    // record past the end of the image
+    if (rom_data == NULL) return 0;
+
+    // compare patch bytes
+    if (currentPatch->rle) {
+      if (kernel->runLength(rom_data, currentPatch->byte_val, chunk) != chunk) return 0;
     } else {
-      // patch bytes
-      fwrite(current->patchValue, LINEAR_16(current->r->size), 1, destRom);
+      if (kernel->matchLength(rom_data, RECORD_DATA(patches, currentPatch) + done, chunk) != chunk) return 0;
     }
+    done += chunk;
+  }
+  return 1;
+}
+
+// compare every record against the ROM image in one sweep (offset order).
+// bit i of bitmap is set when record i is already applied; returns the number of applied records.
+uint32_t verifyPatch(romImage *rom, patchSet *patches, uint8_t *bitmap) {
+  compareKernel *kernel = selectCompareKernel();
+  // rom bytes to be matched against patch, for file backed images
+  uint8_t scratch[IPS_MAX_RECORD_SIZE];
+  uint32_t applied = 0;
 
-    // advance patch pointer
-    current = current->next;
+  memset(bitmap, 0, BITMAP_BYTES(count(patches)));
+  for (uint32_t i=0; i<count(patches); i++) {
+    if (!recordMatches(rom, patches, &patches->records[i], kernel, scratch)) continue;
+    BITMAP_SET(bitmap, i);
+    applied++;
   }
+  return applied;
+}
 
-  // return patched rom descriptor
-  fseek(destRom, 0L, SEEK_SET);
-  printf("[PATCH] Complete.\n");
-  return destRom;
+// size of an image of 'size' bytes once patched: grown to the furthest record, then truncated
+size_t patchedSize(patchSet *patches, size_t size) {
+  if (patches->maxEnd > size) size = patches->maxEnd;
+  if (patches->truncate && (patches->truncateSize < size)) size = patches->truncateSize;
+  return size;
 }
 
-// MAIN FUNCTION
-int main(int argc, char **argv) {
-  // local vars
-  unsigned int opt;
-  unsigned char *patchFileName = NULL;
-  unsigned char *sourceRomFileName = NULL;
-  unsigned char *destinationRomFileName = NULL;
-  recordEntry *patchHead = NULL;
-  // file descriptors
-  FILE *srcRom = NULL, *dstRom = NULL, *patch = NULL;
+// a patch is already applied when every record matches and it leaves the ROM size as it
+// is (no growth, no truncation): the patching modes then write no destination
+int patchComplete(romImage *rom, patchSet *patches, uint32_t applied) {
+  return (applied == count(patches)) && (patchedSize(patches, rom->size) == rom->size);
+}
 
-  // parse command line options
-  while ((opt = getopt(argc, argv, "i:d:p:?")) != -1) {
-    switch (opt) {
-      case 'i':
-        sourceRomFileName = (unsigned char *)optarg;
-        break;
-      case 'd':
-        destinationRomFileName = (unsigned char *)optarg;
-        break;
-      case 'p':
-        patchFileName = (unsigned char *)optarg;
-        break;
-      case '?':
-        if (optopt == 'i') {
-          printf("[i option] : Input ROM File Name is a mandatory option: please specify a ROM File Name.\n");
-        } else if (optopt == 'd') {
-          printf("[d option] : Destination ROM File Name is missing: please specify a Destination ROM File Name.\n");
-        } else if (optopt == 'p') {
-          printf("[p option] : Missing IPS Patch File Name: Cannot patch anything without one.\n");
-        } else {
-          printf("Bad Option Detected: %c\n", optopt);
-        }
-        exit(-1);
+// report the verification result; returns 1 when the whole patch is applied
+uint8_t reportVerify(romImage *rom, patchSet *patches, uint8_t *bitmap, uint32_t applied) {
+  uint32_t i;
+
+  if (applied == count(patches)) {
+    if (patchComplete(rom, patches, applied)) {
+      LOG("%s\n", "[VERIFY]: Patch Applied OK or ROM Already Patched.");
+      return 1;
     }
+    LOG("[VERIFY] Records match, ROM size changes: 0x%zX -> 0x%zX\n", rom->size, patchedSize(patches, rom->size));
+    return 0;
   }
+  for (i = 0; (i < count(patches)) && BITMAP_TEST(bitmap, i); i++);
+  LOG("[VERIFY] Byte Mismatch @offset: 0x%X\n", patches->records[i].offset);
+  if (applied > 0) LOG("[VERIFY] Partially Patched ROM: %u of %u records already applied.\n", applied, count(patches));
+  return 0;
+}
 
-  // sanity check
-  if ((patchFileName == NULL) || (sourceRomFileName == NULL) || (destinationRomFileName == NULL)) {
-    printf("Missing input parameters.\n");
-    exit(-1);
+// checks whether a patch set is already applied to a ROM image
+uint8_t patchApplied(romImage *rom, patchSet *patches) {
+  uint8_t *bitmap;
+  uint8_t ret;
+
+  bitmap = (uint8_t *)malloc(BITMAP_BYTES(count(patches)) + 1);
+  if (!bitmap) {
+    printf("%s\n", "Out of Memory.");
+    return 0;
   }
-  printf("Patch File: [%s]\nSource ROM: [%s]\nDestination ROM: [%s]\n", patchFileName, sourceRomFileName, destinationRomFileName);
+  ret = reportVerify(rom, patches, bitmap, verifyPatch(rom, patches, bitmap));
+  free(bitmap);
+  return ret;
+}
 
-  // load IPS Patch
-  patch = openFile((const char *)patchFileName);
-  if (patch) {
-    if (!checkValidPatch(patch)) {
-      closeFile(patch);
-      printf("[%s] Patch File Is Invalid.\n", patchFileName);
-      exit(-1);
-    } else {
-      // load patch entries
-      patchHead = loadIpsPatch(patch);
-      if (!patchHead) {
-        closeFile(patch);
-        printf("[%s] Cannot Load Patches from IPS File.\n", patchFileName);
-        exit(-1);
+// write one record to a file backed image
+int writeRecordFile(romImage *rom, patchSet *patches, recordEntry *current) {
+  uint8_t run[IPS_MAX_RECORD_SIZE];
+  uint32_t done = 0, chunk;
+
+  if (!current->rle) return pwriteAll(rom->fd, RECORD_DATA(patches, current), current->size, rom->base + current->offset);
+
+  memset(run, current->byte_val, (current->size < IPS_MAX_RECORD_SIZE) ? current->size : IPS_MAX_RECORD_SIZE);
+  while (done < current->size) {
+    chunk = ((current->size - done) < IPS_MAX_RECORD_SIZE) ? (current->size - done) : IPS_MAX_RECORD_SIZE;
+    if (!pwriteAll(rom->fd, run, chunk, (off_t)(rom->base + current->offset + done))) return 0;
+    done += chunk;
+  }
+  return 1;
+}
+
+// CHECKSUM FIX-UP
+// find the header checksum of the source ROM. auto mode picks Mega Drive when the header
+// carries the SEGA system name, else SNES when a valid complement/checksum pair is found.
+// returns 0 (fix->kind is CHECKSUM_NONE) when there is no checksum to fix
+int detectChecksum(romImage *rom, int mode, checksumFix *fix) {
+  static const uint32_t snesHeaders[2] = { SNES_LOROM_CHECKSUM, SNES_HIROM_CHECKSUM };
+  uint8_t scratch[16];
+  const uint8_t *bytes;
+  uint32_t complement, checksum, power;
+  int h;
+
+  memset(fix, 0, sizeof(struct CHECKSUM_FIX));
+  if (mode == CHECKSUM_NONE) return 0;
+
+  if (((mode == CHECKSUM_AUTO) || (mode == CHECKSUM_MD)) && (rom->size >= MD_CHECKSUM_START)) {
+    bytes = romBytes(rom, MD_SYSTEM_OFFSET, 16, scratch);
+    if ((mode == CHECKSUM_MD) || (bytes && memmem(bytes, 16, "SEGA", 4))) {
+      if (!(bytes = romBytes(rom, MD_CHECKSUM_OFFSET, 2, scratch))) return 0;
+      fix->kind = CHECKSUM_MD;
+      fix->offset = MD_CHECKSUM_OFFSET;
+      fix->length = 2;
+      fix->stored = (uint16_t)((bytes[0] << 8) | bytes[1]);
+      LOG("[CHECKSUM] Mega Drive header checksum: 0x%04X\n", fix->stored);
+      return 1;
+    }
+  }
+
+  if ((mode == CHECKSUM_AUTO) || (mode == CHECKSUM_SNES)) {
+    for (h = 0; h < 2; h++) {
+      if (!(bytes = romBytes(rom, snesHeaders[h], 4, scratch))) continue;
+      complement = bytes[0] | (bytes[1] << 8);
+      checksum = bytes[2] | (bytes[3] << 8);
+      if ((complement ^ checksum) != 0xFFFF) continue;
+
+      fix->offset = snesHeaders[h];
+      fix->length = 4;
+      fix->stored = (uint16_t)checksum;
+      // the tail past the largest power of two is mirrored to fill the next one
+      for (power = 1; (size_t)power * 2 <= rom->size; power *= 2);
+      fix->mirrorStart = (uint32_t)rom->size;
+      fix->mirrorWeight = 1;
+      if (rom->size > power) {
+        if (((rom->size - power) & (rom->size - power - 1)) != 0) {
+          LOG("[CHECKSUM] Unsupported SNES ROM size: checksum not updated.\n");
+          return 0;
+        }
+        fix->mirrorStart = power;
+        fix->mirrorWeight = (uint32_t)(power / (rom->size - power));
       }
+      fix->kind = CHECKSUM_SNES;
+      LOG("[CHECKSUM] SNES %s header checksum: 0x%04X\n", h ? "HiROM" : "LoROM", fix->stored);
+      return 1;
     }
-  } else {
-    printf("Cannot Open File [%s]\n", patchFileName);
-    exit(-1);
   }
-  // load source rom
-  srcRom = openFile((const char *)sourceRomFileName);
-  if (!srcRom) {
-    printf("Cannot Open File [%s]\n", sourceRomFileName);
-    if (patch) closeFile(patch);
-    exit(-1);
+  if (mode != CHECKSUM_AUTO) LOG("[CHECKSUM] No %s header checksum found.\n", (mode == CHECKSUM_MD) ? "Mega Drive" : "SNES");
+  return 0;
+}
+
+// weight of the byte at offset in the checksummed sum (0: not summed)
+uint32_t checksumWeight(checksumFix *fix, size_t offset) {
+  if (fix->kind == CHECKSUM_MD) {
+    if (offset < MD_CHECKSUM_START) return 0;
+    return (offset & 1) ? 1 : 0x100;
   }
+  if ((offset >= fix->offset) && (offset < fix->offset + fix->length)) return 0;
+  return (offset >= fix->mirrorStart) ? fix->mirrorWeight : 1;
+}
 
-  // check patch status
-  if (patchApplied(srcRom, patchHead)) {
-    printf("[PATCH VALIDATION] Source ROM Already Patched.\n");
-  } else {
-    // destination ROM file
-    dstRom = dupeFile(srcRom, destinationRomFileName);
-    if (!dstRom) {
-      printf("Cannot Open File [%s]\n", destinationRomFileName);
-      destroy(patchHead);
-      if (patch) closeFile(patch);
-      if (srcRom) closeFile(srcRom);
-      exit(-1);
-    }
+// change of the checksummed sum: weight * (new - old) for every byte about to be written
+// and kept, bytes past the end of the source reading as zeros, then minus the source bytes
+// dropped by a truncation. The checksum is left alone when the patch writes it, and for
+// SNES ROMs changing size (the byte weights would all change)
+int checksumDelta(romImage *rom, patchSet *patches, uint8_t *bitmap, checksumFix *fix) {
+  uint8_t scratch[IPS_MAX_RECORD_SIZE];
+  recordEntry *current;
+  const uint8_t *bytes;
+  size_t finalSize = patchedSize(patches, rom->size), start, end, available;
+  uint32_t i, j, chunk, delta = 0;
+  uint8_t newByte;
 
-    // apply patch to file
-    dstRom = applyPatch(dstRom, patchHead);
-    fflush(dstRom); fseek(dstRom, 0L, SEEK_SET); closeFile(dstRom);
+  if (patches->fileOrder) {
+    LOG("[CHECKSUM] Overlapping records: checksum not updated.\n");
+    fix->kind = CHECKSUM_NONE;
+    return 1;
+  }
+  if ((fix->kind == CHECKSUM_SNES) && (finalSize != rom->size)) {
+    LOG("[CHECKSUM] The patch changes the SNES ROM size: checksum not updated.\n");
+    fix->kind = CHECKSUM_NONE;
+    return 1;
+  }
 
-    // verify patch
-    dstRom = openFile((const char *)destinationRomFileName);
-    if (!patchApplied(dstRom, patchHead)) {
-      printf("[PATCH VALIDATION FAILED] Destination ROM Not Patched.\n");
+  for (i = 0; i < count(patches); i++) {
+    current = &patches->records[i];
+    if (bitmap && BITMAP_TEST(bitmap, i)) continue;
+    if ((current->offset < fix->offset + fix->length) && (current->offset + current->size > fix->offset)) {
+      LOG("[CHECKSUM] The patch writes the header checksum itself: left as is.\n");
+      fix->kind = CHECKSUM_NONE;
+      return 1;
+    }
+    end = current->offset + current->size;
+    if (end > finalSize) end = finalSize;
+    for (start = current->offset; start < end; start += chunk) {
+      chunk = ((end - start) < IPS_MAX_RECORD_SIZE) ? (uint32_t)(end - start) : IPS_MAX_RECORD_SIZE;
+      available = (start < rom->size) ? rom->size - start : 0;
+      if (available > chunk) available = chunk;
+      bytes = (available > 0) ? romBytes(rom, start, available, scratch) : NULL;
+      if ((available > 0) && !bytes) return 0;
+      for (j = 0; j < chunk; j++) {
+        newByte = (current->rle) ? current->byte_val : RECORD_DATA(patches, current)[start - current->offset + j];
+        delta += checksumWeight(fix, start + j) * ((uint32_t)newByte - ((j < available) ? bytes[j] : 0));
+      }
     }
   }
-  destroy(patchHead);
 
-  // closeup and exit
-  if (patch) closeFile(patch);
-  if (srcRom) closeFile(srcRom);
-  if (dstRom) closeFile(dstRom);
-  exit(0);
+  for (start = finalSize; start < rom->size; start += chunk) {
+    chunk = ((rom->size - start) < IPS_MAX_RECORD_SIZE) ? (uint32_t)(rom->size - start) : IPS_MAX_RECORD_SIZE;
+    if (!(bytes = romBytes(rom, start, chunk, scratch))) return 0;
+    for (j = 0; j < chunk; j++) delta -= checksumWeight(fix, start + j) * bytes[j];
+  }
+  fix->delta = delta;
+  return 1;
 }
 
+// write the updated checksum to the patched image
+int fixChecksum(romImage *rom, checksumFix *fix) {
+  uint16_t checksum = (uint16_t)(fix->stored + fix->delta), complement = (uint16_t)~checksum;
+  uint8_t word[4];
+
+  if ((fix->kind == CHECKSUM_NONE) || (fix->offset + fix->length > rom->size)) return 1;
+  if (fix->kind == CHECKSUM_MD) {
+    word[0] = (uint8_t)(checksum >> 8); word[1] = (uint8_t)checksum;
+  } else {
+    word[0] = (uint8_t)complement; word[1] = (uint8_t)(complement >> 8);
+    word[2] = (uint8_t)checksum; word[3] = (uint8_t)(checksum >> 8);
+  }
+  if (rom->data) {
+    memcpy(rom->data + fix->offset, word, fix->length);
+  } else if (!pwriteAll(rom->fd, word, fix->length, rom->base + fix->offset)) {
+    return 0;
+  }
+  LOG("[CHECKSUM] Header checksum updated: 0x%04X -> 0x%04X\n", fix->stored, checksum);
+  return 1;
+}
+
+// UNDO CAPTURE
+// add size bytes written at 'offset' as records, bytes being the payload at position 'data'
+// of the set payload: long runs of one byte become RLE records, the rest literal records
+int addRuns(patchSet *set, const uint8_t *bytes, uint32_t offset, uint32_t size, uint32_t data, compareKernel *kernel) {
+  recordEntry *r;
+  uint32_t position = 0, literal = 0, run;
+
+  while (position < size) {
+    run = 1 + (uint32_t)kernel->runLength(bytes + position + 1, bytes[position], size - position - 1);
+    if (run < IPS_RLE_MIN_RUN) {
+      position += run;
+      continue;
+    }
+    // flush pending literal bytes, then the run
+    if (literal < position) {
+      if (!(r = appendItem(set))) return 0;
+      r->offset = offset + literal; r->size = position - literal; r->data = data + literal;
+    }
+    if (!(r = appendItem(set))) return 0;
+    r->offset = offset + position; r->size = run; r->rle = 1; r->byte_val = bytes[position];
+    position += run;
+    literal = position;
+  }
+  if (literal < size) {
+    if (!(r = appendItem(set))) return 0;
+    r->offset = offset + literal; r->size = size - literal; r->data = data + literal;
+  }
+  return 1;
+}
+
+// first byte captured for a range starting at offset: no record can start at
+// IPS_EOF_OFFSET, the source byte before it is captured along
+size_t captureStart(size_t offset) {
+  return (offset == IPS_EOF_OFFSET) ? offset - 1 : offset;
+}
+
+// copy the image bytes [start, end) to the undo arena, as records
+int captureRange(patchSet *undo, romImage *rom, size_t start, size_t end, compareKernel *kernel, uint8_t *scratch) {
+  const uint8_t *bytes;
+  uint8_t *payload;
+  uint32_t position, chunk;
+
+  for (; start < end; start += chunk) {
+    chunk = ((end - start) < IPS_MAX_RECORD_SIZE) ? (uint32_t)(end - start) : IPS_MAX_RECORD_SIZE;
+    bytes = romBytes(rom, start, chunk, scratch);
+    payload = arenaAlloc(undo, chunk, &position);
+    if (!bytes || !payload) return 0;
+    memcpy(payload, bytes, chunk);
+    if (!addRuns(undo, payload, (uint32_t)start, chunk, position, kernel)) return 0;
+  }
+  return 1;
+}
+
+// the source bytes under the records about to be written (and under the end of the ROM
+// a truncation drops, and under a header checksum about to be fixed), as a patch restoring
+// them. a grown ROM is truncated back
+patchSet *captureUndo(romImage *rom, patchSet *patches, uint8_t *bitmap, checksumFix *checksum) {
+  compareKernel *kernel = selectCompareKernel();
+  uint8_t scratch[IPS_MAX_RECORD_SIZE];
+  patchSet *undo;
+  recordEntry *current;
+  size_t arenaSize = 0, finalSize, end;
+  uint32_t i;
+
+  // final size, as applyPatch leaves it
+  finalSize = patchedSize(patches, rom->size);
+  if (checksum && ((checksum->kind == CHECKSUM_NONE) || (checksum->offset + checksum->length > finalSize))) checksum = NULL;
+
+  for (i = 0; i < count(patches); i++) {
+    current = &patches->records[i];
+    if ((bitmap && !patches->fileOrder && BITMAP_TEST(bitmap, i)) || (current->offset >= rom->size)) continue;
+    end = (current->offset + current->size < rom->size) ? current->offset + current->size : rom->size;
+    arenaSize += end - captureStart(current->offset);
+  }
+  if (finalSize < rom->size) arenaSize += rom->size - captureStart(finalSize);
+  if (checksum) arenaSize += checksum->length;
+  undo = newPatchSet(arenaSize);
+  if (!undo) return NULL;
+
+  for (i = 0; i < count(patches); i++) {
+    current = &patches->records[i];
+    if ((bitmap && !patches->fileOrder && BITMAP_TEST(bitmap, i)) || (current->offset >= rom->size)) continue;
+    end = (current->offset + current->size < rom->size) ? current->offset + current->size : rom->size;
+    if (!captureRange(undo, rom, captureStart(current->offset), end, kernel, scratch)) goto fail;
+  }
+  if ((finalSize < rom->size) && !captureRange(undo, rom, captureStart(finalSize), rom->size, kernel, scratch)) goto fail;
+  if (checksum && !captureRange(undo, rom, checksum->offset, checksum->offset + checksum->length, kernel, scratch)) goto fail;
+  if (finalSize > rom->size) {
+    undo->truncate = 1;
+    undo->truncateSize = (uint32_t)rom->size;
+  }
+  if (sortRecords(undo)) return undo;
+
+fail:
+  destroy(undo);
+  return NULL;
+}
+
+// patch the part of the image inside one offset range (thread entry point)
+void *applyRangeWorker(void *arg) {
+  applyRange *range = (applyRange *)arg;
+  patchSet *patches = range->patches;
+  recordEntry *current;
+  uint32_t i = 0, lo, hi, mid, index, from, to;
+
+  // sorted, non-overlapping records: start from the first record ending in the range
+  if (!patches->fileOrder) {
+    lo = 0; hi = count(patches);
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (patches->records[mid].offset + patches->records[mid].size <= range->start) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    i = lo;
+  }
+  for (; i < count(patches); i++) {
+    current = recordAt(patches, i);
+    if (!patches->fileOrder && (current->offset >= range->end)) break;
+    index = (uint32_t)(current - patches->records);
+    if (range->bitmap && !patches->fileOrder && BITMAP_TEST(range->bitmap, index)) continue;
+
+    from = (current->offset > range->start) ? current->offset : range->start;
+    to = (current->offset + current->size < range->end) ? current->offset + current->size : range->end;
+    if (from >= to) continue;
+    if (current->rle) {
+      memset(range->rom->data + from, current->byte_val, to - from);
+    } else {
+      memcpy(range->rom->data + from, RECORD_DATA(patches, current) + (from - current->offset), to - from);
+    }
+  }
+  return NULL;
+}
+
+// apply the records of an in memory (or mapped) image on several threads, each one
+// patching its own offset range
+void applyParallel(romImage *rom, patchSet *patches, uint8_t *bitmap, int threads) {
+  applyRange ranges[IPS_MAX_THREADS];
+  pthread_t workers[IPS_MAX_THREADS];
+  uint8_t started[IPS_MAX_THREADS];
+  uint64_t total = 0, done = 0, target;
+  uint32_t i, cut;
+  int t = 0;
+
+  for (i = 0; i < count(patches); i++) total += patches->records[i].size;
+  if ((uint64_t)threads > total / IPS_PARALLEL_MIN_BYTES + 1) threads = (int)(total / IPS_PARALLEL_MIN_BYTES + 1);
+  if (threads > IPS_MAX_THREADS) threads = IPS_MAX_THREADS;
+
+  // cut the image where the bytes to write (in offset order) reach each share
+  ranges[0].start = 0;
+  for (i = 0; (i < count(patches)) && (t + 1 < threads); i++) {
+    while ((t + 1 < threads) && (done + patches->records[i].size >= (target = total * (t + 1) / threads))) {
+      cut = patches->records[i].offset + (uint32_t)(target - done);
+      if (cut < ranges[t].start) cut = ranges[t].start;
+      ranges[t].end = cut;
+      ranges[++t].start = cut;
+    }
+    done += patches->records[i].size;
+  }
+  ranges[t].end = UINT32_MAX;
+  threads = t + 1;
+
+  for (t = 0; t < threads; t++) {
+    ranges[t].rom = rom;
+    ranges[t].patches = patches;
+    ranges[t].bitmap = bitmap;
+    started[t] = (t > 0) && (pthread_create(&workers[t], NULL, applyRangeWorker, &ranges[t]) == 0);
+  }
+  // the first range (and any range without a thread) is patched here
+  for (t = 0; t < threads; t++) {
+    if (!started[t]) applyRangeWorker(&ranges[t]);
+  }
+  for (t = 1; t < threads; t++) {
+    if (started[t]) pthread_join(workers[t], NULL);
+  }
+  LOG("[PATCH] %d offset ranges patched in parallel.\n", threads);
+}
+
+// apply patches to a rom image.
+// in memory, the image is grown once to fit the furthest record, then every record
+// is a memcpy (or a memset for RLE records); file backed images get one pwrite per record.
+// with a status bitmap (from verifyPatch), records already in the ROM are not written
+// again and the records written are flagged as applied, so they need no second verify.
+// in memory (and mapped) images are patched by 'threads' threads, in offset ranges.
+// when undo is not NULL, the source bytes about to be overwritten are saved first in a
+// new patch set (*undo) that restores them. when checksum is not NULL, the header checksum
+// it describes is updated from the bytes the records replace
+int applyPatch(romImage *rom, patchSet *patches, uint8_t *bitmap, int threads, patchSet **undo, checksumFix *checksum) {
+  // pointer to the next unapplied patch
+  recordEntry *current = NULL;
+  uint32_t index, written = 0;
+
+  if (checksum && !checksumDelta(rom, patches, bitmap, checksum)) return 0;
+  if (undo && !(*undo = captureUndo(rom, patches, bitmap, checksum))) return 0;
+  if (rom->data && !growRom(rom, patches->maxEnd)) return 0;
+
+  if (rom->data && (threads > 1)) {
+    // the bitmap is only read by the threads, records written are flagged here
+    for (uint32_t i=0; i<count(patches); i++) {
+      if (bitmap && !patches->fileOrder && BITMAP_TEST(bitmap, i)) continue;
+      written++;
+    }
+    applyParallel(rom, patches, bitmap, threads);
+    if (bitmap) memset(bitmap, 0xFF, BITMAP_BYTES(count(patches)));
+  } else {
+    // loop over available patches
+    for (unsigned int i=0; i<count(patches); i++) {
+      current = recordAt(patches, i);
+      index = (uint32_t)(current - patches->records);
+      // overlapping records are all rewritten: a record already in place may be covered by an earlier one first
+      if (bitmap && !patches->fileOrder && BITMAP_TEST(bitmap, index)) continue;
+
+      // apply patch
+      if (rom->data == NULL) {
+        if (!writeRecordFile(rom, patches, current)) return 0;
+      } else if (current->rle) { // patch is RLE Encoded
+        memset(rom->data + current->offset, current->byte_val, current->size);
+      } else {
+        memcpy(rom->data + current->offset, RECORD_DATA(patches, current), current->size);
+      }
+      if (bitmap) BITMAP_SET(bitmap, index);
+      written++;
+    }
+  }
+  if (patches->maxEnd > rom->size) rom->size = patches->maxEnd;
+
+  // truncation extension
+  if (patches->truncate && (patches->truncateSize < rom->size)) {
+    if ((rom->fd >= 0) && (ftruncate(rom->fd, rom->base + patches->truncateSize) != 0)) return 0;
+    rom->size = patches->truncateSize;
+  }
+
+  LOG("[PATCH] Complete: %u records written.\n", written);
+  return (checksum) ? fixChecksum(rom, checksum) : 1;
+}
+
+// PATCH WRITER
+// write a record header (and the RLE body) in IPS wire format
+int writeRecordHeader(FILE *out, uint32_t offset, uint32_t size, uint8_t rle, uint8_t byte_val) {
+  uint8_t header[sizeof(union IPS_RECORD_HEADER) + sizeof(struct IPS_RLE_RECORD)];
+  size_t length = sizeof(union IPS_RECORD_HEADER);
+
+  header[0] = (uint8_t)(offset >> 16); header[1] = (uint8_t)(offset >> 8); header[2] = (uint8_t)offset;
+  header[3] = (rle) ? 0 : (uint8_t)(size >> 8);
+  header[4] = (rle) ? 0 : (uint8_t)size;
+  if (rle) {
+    header[5] = (uint8_t)(size >> 8); header[6] = (uint8_t)size; header[7] = byte_val;
+    length += sizeof(struct IPS_RLE_RECORD);
+  }
+  return fwrite(header, length, 1, out) == 1;
+}
+
+// write one record, split in chunks that fit the 16-bit size field.
+// a chunk cannot start at IPS_EOF_OFFSET (it would read as the EOF tag): it is moved one
+// byte back, carrying the byte before it (from 'image', the patched ROM when known, or from
+// the previous record when it ends right there).
+int writeRecord(FILE *out, patchSet *set, recordEntry *r, const uint8_t *image, size_t imageSize, int prevByte) {
+  uint32_t done = 0, chunk, offset;
+  const uint8_t *data = (r->rle) ? NULL : RECORD_DATA(set, r);
+  uint8_t before;
+
+  while (done < r->size) {
+    offset = r->offset + done;
+    chunk = r->size - done;
+    if (offset > IPS_MAX_OFFSET) return 0;
+
+    if (offset == IPS_EOF_OFFSET) {
+      if (done > 0) before = (r->rle) ? r->byte_val : data[done - 1];
+      else if (image && (offset <= imageSize)) before = image[offset - 1];
+      else if (prevByte >= 0) before = (uint8_t)prevByte;
+      else return 0;
+
+      if (r->rle && (before == r->byte_val)) {
+        if (chunk > IPS_MAX_RECORD_SIZE - 1) chunk = IPS_MAX_RECORD_SIZE - 1;
+        if (!writeRecordHeader(out, offset - 1, chunk + 1, 1, r->byte_val)) return 0;
+      } else {
+        // short literal: the byte before plus one byte of the record
+        chunk = 1;
+        if (!writeRecordHeader(out, offset - 1, 2, 0, 0)) return 0;
+        if (fputc(before, out) == EOF) return 0;
+        if (fputc((r->rle) ? r->byte_val : data[done], out) == EOF) return 0;
+      }
+    } else {
+      if (chunk > IPS_MAX_RECORD_SIZE) chunk = IPS_MAX_RECORD_SIZE;
+      // the next chunk must not start at IPS_EOF_OFFSET either: stop one byte later
+      if ((offset < IPS_EOF_OFFSET) && (offset + chunk == IPS_EOF_OFFSET) && (chunk < r->size - done)) chunk--;
+      if (!writeRecordHeader(out, offset, chunk, r->rle, r->byte_val)) return 0;
+      if (!r->rle && (fwrite(data + done, chunk, 1, out) != 1)) return 0;
+    }
+    done += chunk;
+  }
+  return 1;
+}
+
+// write a patch set as an IPS file (records in file order, truncation extension included)
+int writeIpsPatch(patchSet *set, const char *patchName, const uint8_t *image, size_t imageSize) {
+  FILE *out = NULL;
+  recordEntry *r, *prev = NULL;
+  int prevByte, ok = 1;
+  uint8_t truncate[3];
+
+  out = fopen(patchName, "w");
+  if (!out) return 0;
+  if (fwrite(IPS_MAGIC_TAG, IPS_MAGIC_SIZE, 1, out) != 1) ok = 0;
+
+  for (uint32_t i = 0; ok && (i < count(set)); i++) {
+    r = recordAt(set, i);
+    prevByte = -1;
+    if (prev && (prev->offset + prev->size == r->offset) && (prev->size > 0))
+      prevByte = (prev->rle) ? prev->byte_val : RECORD_DATA(set, prev)[prev->size - 1];
+    ok = writeRecord(out, set, r, image, imageSize, prevByte);
+    prev = r;
+  }
+
+  if (ok && (fwrite(IPS_END_TAG, IPS_END_SIZE, 1, out) != 1)) ok = 0;
+  if (ok && set->truncate) {
+    truncate[0] = (uint8_t)(set->truncateSize >> 16); truncate[1] = (uint8_t)(set->truncateSize >> 8); truncate[2] = (uint8_t)set->truncateSize;
+    if (fwrite(truncate, sizeof(truncate), 1, out) != 1) ok = 0;
+  }
+  if (fclose(out) != 0) ok = 0;
+  return ok;
+}
+
+// PATCH CREATION
+// add the changed range [start, end) of image as records: long runs of one byte become
+// RLE records, the rest literal records with payloads read in place from image
+int addRange(patchSet *set, const uint8_t *image, uint32_t start, uint32_t end, compareKernel *kernel) {
+  return addRuns(set, image + start, start, end - start, start, kernel);
+}
+
+// diff two ROM images into a patch set (payloads point into modified).
+// unchanged stretches are skipped with the vectorized compare kernel.
+patchSet *diffRoms(romImage *original, romImage *modified) {
+  compareKernel *kernel = selectCompareKernel();
+  patchSet *set = NULL;
+  size_t common = (original->size < modified->size) ? original->size : modified->size;
+  size_t position = 0, start, end, equal;
+
+  // offsets are 24-bit: changes past 16MB cannot be described
+  if (modified->size > (size_t)IPS_MAX_OFFSET + 1) return NULL;
+  set = newPatchSet(0);
+  if (!set) return NULL;
+  set->payload = modified->data;
+
+  while (position < common) {
+    position += kernel->matchLength(original->data + position, modified->data + position, common - position);
+    if (position >= common) break;
+
+    // extend the changed range until IPS_DIFF_GAP unchanged bytes (or the end)
+    start = position;
+    end = position + 1;
+    while (end < common) {
+      equal = kernel->matchLength(original->data + end, modified->data + end, ((common - end) < IPS_DIFF_GAP) ? (common - end) : IPS_DIFF_GAP);
+      if ((equal >= IPS_DIFF_GAP) || (end + equal == common)) break;
+      end += equal + 1;
+    }
+    // a range running into the appended data is carried on in one piece
+    if ((end == common) && (modified->size > common)) end = modified->size;
+    if (!addRange(set, modified->data, (uint32_t)start, (uint32_t)end, kernel)) {
+      destroy(set);
+      return NULL;
+    }
+    position = end;
+  }
+
+  // data appended to the original ROM, or truncation
+  if ((position < modified->size) && (modified->size > common)) {
+    if (!addRange(set, modified->data, (uint32_t)common, (uint32_t)modified->size, kernel)) {
+      destroy(set);
+      return NULL;
+    }
+  }
+  if (modified->size < original->size) {
+    set->truncate = 1;
+    set->truncateSize = (uint32_t)modified->size;
+  }
+
+  if (!sortRecords(set)) {
+    destroy(set);
+    return NULL;
+  }
+  return set;
+}
+
+// create mode: diff an original and a modified ROM into an IPS patch (copier headers are
+// left out of the diff, as they are when the patch is applied). The header is detected on
+// the original only: the modified ROM may have grown, it keeps the same header
+int createPatch(const char *originalName, const char *modifiedName, const char *patchName, int headerMode) {
+  FILE *originalFile = NULL, *modifiedFile = NULL;
+  romImage *original = NULL, *modified = NULL;
+  patchSet *set = NULL;
+  size_t base = 0;
+  int ret = -1;
+
+  originalFile = openFile(originalName);
+  modifiedFile = openFile(modifiedName);
+  if (originalFile) base = romHeader(fileno(originalFile), headerMode);
+  if (originalFile) original = mapRom(originalFile, base);
+  if (modifiedFile && originalFile) modified = mapRom(modifiedFile, base);
+  if (!original || !modified) {
+    printf("Cannot Load ROM Files [%s] [%s]\n", originalName, modifiedName);
+  } else {
+    set = diffRoms(original, modified);
+    if (!set) {
+      printf("[CREATE] Cannot describe the changes as an IPS patch (ROM bigger than 16MB?).\n");
+    } else if (!writeIpsPatch(set, patchName, modified->data, modified->size)) {
+      printf("Cannot Write File [%s]\n", patchName);
+    } else {
+      printf("[CREATE] %u records written to [%s].\n", count(set), patchName);
+      ret = 0;
+    }
+  }
+
+  destroy(set);
+  freeRom(original);
+  freeRom(modified);
+  if (originalFile) closeFile(originalFile);
+  if (modifiedFile) closeFile(modifiedFile);
+  return ret;
+}
+
+// PATCH STACKING
+int compareMergeItems(const void *a, const void *b) {
+  const mergeItem *ia = (const mergeItem *)a;
+  const mergeItem *ib = (const mergeItem *)b;
+
+  if (ia->start != ib->start) return (ia->start < ib->start) ? -1 : 1;
+  return 0;
+}
+
+int compareOffsets(const void *a, const void *b) {
+  uint32_t oa = *(const uint32_t *)a, ob = *(const uint32_t *)b;
+  return (oa < ob) ? -1 : (oa > ob);
+}
+
+// binary max-heap of merge item indexes, ordered by priority
+void heapPush(uint32_t *heap, uint32_t *size, mergeItem *items, uint32_t item) {
+  uint32_t i = (*size)++, parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (items[heap[parent]].priority >= items[item].priority) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = item;
+}
+
+void heapPop(uint32_t *heap, uint32_t *size, mergeItem *items) {
+  uint32_t i = 0, child, item = heap[--(*size)];
+
+  while ((child = 2 * i + 1) < *size) {
+    if ((child + 1 < *size) && (items[heap[child + 1]].priority > items[heap[child]].priority)) child++;
+    if (items[item].priority >= items[heap[child]].priority) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = item;
+}
+
+// append the bytes [start, end) of a merge item to the merged set, coalescing with the
+// previous record when they touch: literal runs are joined, RLE runs of the same byte
+// are joined, and short RLE runs are folded into neighbouring literal records
+int mergePiece(patchSet *out, mergeItem *item, uint32_t start, uint32_t end) {
+  recordEntry *last = (out->count > 0) ? &out->records[out->count - 1] : NULL;
+  recordEntry *r = item->record;
+  uint32_t length = end - start, position;
+  uint8_t *payload;
+
+  if (last && (last->offset + last->size != start)) last = NULL;
+
+  if (r->rle) {
+    if (last && last->rle && (last->byte_val == r->byte_val)) {
+      last->size += length;
+      return 1;
+    }
+    if (last && !last->rle && (length < IPS_RLE_MIN_RUN)) {
+      // the last literal payload is at the end of the arena: extend it in place
+      if (!(payload = arenaAlloc(out, length, &position))) return 0;
+      memset(payload, r->byte_val, length);
+      last->size += length;
+      return 1;
+    }
+    if (!(last = appendItem(out))) return 0;
+    last->offset = start; last->size = length; last->rle = 1; last->byte_val = r->byte_val;
+    return 1;
+  }
+
+  if (last && last->rle && (last->size < IPS_RLE_MIN_RUN)) {
+    // short run before a literal: turn it into literal bytes
+    if (!(payload = arenaAlloc(out, last->size, &position))) return 0;
+    memset(payload, last->byte_val, last->size);
+    last->rle = 0; last->data = position;
+  } else if (!last || last->rle) {
+    if (!(last = appendItem(out))) return 0;
+    last->offset = start;
+    last->data = (uint32_t)out->arenaUsed;
+  }
+  if (!(payload = arenaAlloc(out, length, &position))) return 0;
+  memcpy(payload, RECORD_DATA(item->set, r) + (start - r->offset), length);
+  last->size += length;
+  return 1;
+}
+
+// merge patches applied in sequence into one normalized set: no overlapping records,
+// adjacent records coalesced. Later patches win where records overlap (and later
+// records win inside a patch), so applying the result once gives the same ROM as
+// applying every patch in turn. A patch growing the ROM past an earlier truncation
+// zero-fills the bytes the truncation dropped: the merged set writes that zero run
+// (past the source end the grown bytes are zeros anyway, so it holds for any source).
+patchSet *mergePatches(patchSet **sets, int setCount) {
+  patchSet *out = NULL;
+  mergeItem *items = NULL;
+  recordEntry *fills = NULL;
+  uint32_t *bounds = NULL, *heap = NULL;
+  uint32_t total = 0, itemCount = 0, boundCount = 0, heapSize = 0, next = 0, i, j, limit, grown;
+  size_t arenaSize = 0;
+  int s, ok = 0, truncating = -1;
+
+  for (s = 0; s < setCount; s++) {
+    total += count(sets[s]);
+    for (i = 0; i < count(sets[s]); i++) {
+      if (!sets[s]->records[i].rle) arenaSize += sets[s]->records[i].size;
+    }
+    if (sets[s]->truncate) truncating = s;
+  }
+  // one zero fill item per truncating patch, on top of the records
+  total += setCount;
+  // folded RLE runs are at most IPS_RLE_MIN_RUN bytes per piece, at most 2 pieces per item
+  arenaSize += (size_t)total * 2 * IPS_RLE_MIN_RUN;
+
+  items = (mergeItem *)malloc((total + 1) * sizeof(struct MERGE_ITEM));
+  fills = (recordEntry *)calloc(setCount, sizeof(struct IPS_PATCH_RECORD));
+  bounds = (uint32_t *)malloc((2 * total + 1) * sizeof(uint32_t));
+  heap = (uint32_t *)malloc((total + 1) * sizeof(uint32_t));
+  out = newPatchSet(arenaSize);
+  if (!items || !fills || !bounds || !heap || !out) goto cleanup;
+
+  for (s = 0; s < setCount; s++) {
+    // records past a later truncation are kept: the ROM grows to their end before it is
+    // truncated, and the merged truncation (or the zero fill below) drops their bytes
+    limit = UINT32_MAX;
+    grown = 0;
+    for (j = s + 1; j < (uint32_t)setCount; j++) {
+      if (sets[j]->truncate && (sets[j]->truncateSize < limit)) limit = sets[j]->truncateSize;
+      if (sets[j]->maxEnd > grown) grown = sets[j]->maxEnd;
+    }
+    // later patches growing past this truncation see zeros in [truncateSize, grown):
+    // the fill ranks above this patch records and below the later patches
+    if (sets[s]->truncate && (grown > sets[s]->truncateSize)) {
+      fills[s].rle = 1;
+      items[itemCount].start = sets[s]->truncateSize;
+      items[itemCount].end = (grown < limit) ? grown : limit;
+      if (items[itemCount].start < items[itemCount].end) {
+        items[itemCount].priority = ((uint64_t)s << 32) | UINT32_MAX;
+        items[itemCount].set = sets[s];
+        items[itemCount].record = &fills[s];
+        bounds[boundCount++] = items[itemCount].start;
+        bounds[boundCount++] = items[itemCount].end;
+        itemCount++;
+      }
+    }
+    for (i = 0; i < count(sets[s]); i++) {
+      items[itemCount].start = sets[s]->records[i].offset;
+      items[itemCount].end = sets[s]->records[i].offset + sets[s]->records[i].size;
+      items[itemCount].priority = ((uint64_t)s << 32) | sets[s]->records[i].seq;
+      items[itemCount].set = sets[s];
+      items[itemCount].record = &sets[s]->records[i];
+      bounds[boundCount++] = items[itemCount].start;
+      bounds[boundCount++] = items[itemCount].end;
+      itemCount++;
+    }
+  }
+  qsort(items, itemCount, sizeof(struct MERGE_ITEM), compareMergeItems);
+  qsort(bounds, boundCount, sizeof(uint32_t), compareOffsets);
+
+  // sweep the elementary intervals between consecutive bounds, the owner of each
+  // interval is the highest priority item covering it
+  for (i = 0; i + 1 < boundCount; i++) {
+    if (bounds[i] == bounds[i + 1]) continue;
+    while ((next < itemCount) && (items[next].start <= bounds[i])) heapPush(heap, &heapSize, items, next++);
+    while ((heapSize > 0) && (items[heap[0]].end <= bounds[i])) heapPop(heap, &heapSize, items);
+    if (heapSize == 0) continue;
+    if (!mergePiece(out, &items[heap[0]], bounds[i], bounds[i + 1])) goto cleanup;
+  }
+
+  // each patch clamps the ROM size between its furthest record and its truncation:
+  // the clamps compose into one, whose upper bound is the merged truncation
+  if (truncating >= 0) {
+    limit = UINT32_MAX;
+    for (s = 0; s < setCount; s++) {
+      grown = sets[s]->maxEnd;
+      if (sets[s]->truncate && (sets[s]->truncateSize < grown)) grown = sets[s]->truncateSize;
+      if (limit < grown) limit = grown;
+      if (sets[s]->truncate && (sets[s]->truncateSize < limit)) limit = sets[s]->truncateSize;
+    }
+    out->truncate = 1;
+    out->truncateSize = limit;
+  }
+  ok = sortRecords(out);
+
+cleanup:
+  if (items) free(items);
+  if (fills) free(fills);
+  if (bounds) free(bounds);
+  if (heap) free(heap);
+  if (!ok) {
+    destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+// UNDO PATCHES
+// byte written at offset by a normalized patch set, -1 when no record covers it
+int patchByte(patchSet *set, uint32_t offset) {
+  recordEntry *r;
+  uint32_t lo = 0, hi = count(set), mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (set->records[mid].offset + set->records[mid].size <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if ((lo == count(set)) || (set->records[lo].offset > offset)) return -1;
+  r = &set->records[lo];
+  return (r->rle) ? r->byte_val : RECORD_DATA(set, r)[offset - r->offset];
+}
+
+// check that the undo patch restores the source ROM: it must give the right size and,
+// over every byte written by the undo patch or captured from the source, the patched
+// image with the undo patch on top must match the source (the captured byte where there
+// is one, the untouched patched byte elsewhere). Both sets are normalized.
+// The undo patch must also be applicable: the patching modes must not take it as already
+// applied (and write nothing) while the patched image differs from the source
+int verifyUndo(romImage *rom, patchSet *undo, patchSet *capture, size_t sourceSize) {
+  uint8_t scratch[IPS_MAX_RECORD_SIZE];
+  patchSet *sets[2] = { undo, capture };
+  const uint8_t *patched;
+  uint8_t *bitmap;
+  size_t restoredSize, start, end, available;
+  uint32_t i, j, chunk;
+  int s, restored, source, current, changed;
+
+  restoredSize = patchedSize(undo, rom->size);
+  if (restoredSize != sourceSize) return 0;
+  changed = (restoredSize != rom->size);
+
+  for (s = 0; s < 2; s++) {
+    for (i = 0; i < count(sets[s]); i++) {
+      start = sets[s]->records[i].offset;
+      end = start + sets[s]->records[i].size;
+      if (end > sourceSize) end = sourceSize;
+      for (; start < end; start += chunk) {
+        chunk = ((end - start) < IPS_MAX_RECORD_SIZE) ? (uint32_t)(end - start) : IPS_MAX_RECORD_SIZE;
+        // bytes past the end of the patched image read as zeros
+        available = (start < rom->size) ? rom->size - start : 0;
+        if (available > chunk) available = chunk;
+        patched = (available > 0) ? romBytes(rom, start, available, scratch) : NULL;
+        if ((available > 0) && !patched) return 0;
+        for (j = 0; j < chunk; j++) {
+          current = (j < available) ? patched[j] : 0;
+          restored = patchByte(undo, (uint32_t)(start + j));
+          source = patchByte(capture, (uint32_t)(start + j));
+          if (((restored >= 0) ? restored : current) != ((source >= 0) ? source : current)) return 0;
+          if ((source >= 0) && (source != current)) changed = 1;
+        }
+      }
+    }
+  }
+
+  // same decision as the patching modes, on the patched image
+  if (!changed) return 1;
+  if (!(bitmap = (uint8_t *)malloc(BITMAP_BYTES(count(undo)) + 1))) return 0;
+  s = !patchComplete(rom, undo, verifyPatch(rom, undo, bitmap));
+  free(bitmap);
+  return s;
+}
+
+// write the undo patch captured by applyPatch, then load it back and check that it
+// restores the source ROM byte for byte (a patch failing the check is removed).
+// undo records never start at IPS_EOF_OFFSET after a gap (see captureStart), so the
+// writer finds the byte before such a record in the previous record
+int writeUndo(romImage *rom, patchSet *capture, const char *undoName, size_t sourceSize) {
+  patchSet *normal = capture, *loaded = NULL, *undo = NULL;
+  int ok = 0;
+
+  if (capture->fileOrder && !(normal = mergePatches(&capture, 1))) return 0;
+  if (writeIpsPatch(normal, undoName, NULL, 0) && (loaded = readPatchFile(undoName))) {
+    undo = loaded;
+    if (loaded->fileOrder) {
+      undo = mergePatches(&loaded, 1);
+      destroy(loaded);
+    }
+    ok = undo && verifyUndo(rom, undo, normal, sourceSize);
+    if (ok) LOG("[UNDO] Undo patch written to [%s] (%u records), verified against the source ROM.\n", undoName, count(undo));
+  }
+  if (!ok) unlink(undoName);
+
+  destroy(undo);
+  if (normal != capture) destroy(normal);
+  return ok;
+}
+
+// PATCH ANALYSIS
+// append a range to a range list
+int pushRange(rangeList *list, uint32_t start, uint32_t end) {
+  struct OFFSET_RANGE *ranges;
+  uint32_t capacity;
+
+  if (list->count == list->capacity) {
+    capacity = list->capacity ? list->capacity * 2 : IPS_INITIAL_RECORDS;
+    ranges = (struct OFFSET_RANGE *)realloc(list->ranges, capacity * sizeof(struct OFFSET_RANGE));
+    if (!ranges) return 0;
+    list->ranges = ranges;
+    list->capacity = capacity;
+  }
+  list->ranges[list->count].start = start;
+  list->ranges[list->count].end = end;
+  list->count++;
+  return 1;
+}
+
+int compareRanges(const void *a, const void *b) {
+  const struct OFFSET_RANGE *ra = (const struct OFFSET_RANGE *)a;
+  const struct OFFSET_RANGE *rb = (const struct OFFSET_RANGE *)b;
+
+  if (ra->start != rb->start) return (ra->start < rb->start) ? -1 : 1;
+  return 0;
+}
+
+// sort and coalesce the ranges of a list in place, returns the number of bytes covered
+uint64_t unionRanges(rangeList *list) {
+  uint64_t covered = 0;
+  uint32_t i, n = 0;
+
+  if (list->count == 0) return 0;
+  qsort(list->ranges, list->count, sizeof(struct OFFSET_RANGE), compareRanges);
+  for (i = 1; i < list->count; i++) {
+    if (list->ranges[i].start <= list->ranges[n].end) {
+      if (list->ranges[i].end > list->ranges[n].end) list->ranges[n].end = list->ranges[i].end;
+    } else {
+      list->ranges[++n] = list->ranges[i];
+    }
+  }
+  list->count = n + 1;
+  for (i = 0; i < list->count; i++) covered += list->ranges[i].end - list->ranges[i].start;
+  return covered;
+}
+
+// fill the maxEnd augmentation of the subtree rooted in the middle of [lo, hi)
+uint32_t buildIndexNode(intervalIndex *index, uint32_t lo, uint32_t hi) {
+  uint32_t mid, maxEnd, child;
+
+  if (lo >= hi) return 0;
+  mid = lo + (hi - lo) / 2;
+  maxEnd = index->end[mid];
+  child = buildIndexNode(index, lo, mid);
+  if (child > maxEnd) maxEnd = child;
+  child = buildIndexNode(index, mid + 1, hi);
+  if (child > maxEnd) maxEnd = child;
+  index->maxEnd[mid] = maxEnd;
+  return maxEnd;
+}
+
+// index the records of a patch set (already sorted by offset, empty records are left out)
+intervalIndex *buildIndex(patchSet *set) {
+  intervalIndex *index;
+  uint32_t i;
+
+  index = (intervalIndex *)calloc(1, sizeof(struct INTERVAL_INDEX));
+  if (!index) return NULL;
+  index->start = (uint32_t *)malloc(3 * ((size_t)count(set) + 1) * sizeof(uint32_t));
+  if (!index->start) {
+    free(index);
+    return NULL;
+  }
+  index->end = index->start + count(set) + 1;
+  index->maxEnd = index->end + count(set) + 1;
+
+  for (i = 0; i < count(set); i++) {
+    if (set->records[i].size == 0) continue;
+    index->start[index->count] = set->records[i].offset;
+    index->end[index->count] = set->records[i].offset + set->records[i].size;
+    index->count++;
+  }
+  if (index->count > 0) {
+    index->spanStart = index->start[0];
+    index->spanEnd = buildIndexNode(index, 0, index->count);
+  }
+  return index;
+}
+
+void freeIndex(intervalIndex *index) {
+  if (!index) return;
+  free(index->start);
+  free(index);
+}
+
+// add the parts of [queryStart, queryEnd) written by the records of the subtree [lo, hi)
+// to hits, in offset order. Subtrees ending before the query or starting after it are
+// skipped, the right subtree is walked iteratively (recursion depth stays O(log n))
+int queryIndex(intervalIndex *index, uint32_t lo, uint32_t hi, uint32_t queryStart, uint32_t queryEnd, rangeList *hits) {
+  uint32_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (index->maxEnd[mid] <= queryStart) return 1;
+    if (!queryIndex(index, lo, mid, queryStart, queryEnd, hits)) return 0;
+    if (index->start[mid] >= queryEnd) return 1;
+    if (index->end[mid] > queryStart) {
+      if (!pushRange(hits, (index->start[mid] > queryStart) ? index->start[mid] : queryStart,
+                     (index->end[mid] < queryEnd) ? index->end[mid] : queryEnd)) return 0;
+    }
+    lo = mid + 1;
+  }
+  return 1;
+}
+
+// bytes written by both patches, as coalesced ranges in hits: every record of the
+// smaller patch is looked up in the index of the bigger one
+int indexOverlap(intervalIndex *a, intervalIndex *b, rangeList *hits) {
+  intervalIndex *swap;
+  uint32_t i;
+
+  hits->count = 0;
+  if ((a->count == 0) || (b->count == 0) || (a->spanEnd <= b->spanStart) || (b->spanEnd <= a->spanStart)) return 1;
+  if (a->count > b->count) {
+    swap = a; a = b; b = swap;
+  }
+  for (i = 0; i < a->count; i++) {
+    if (!queryIndex(b, 0, b->count, a->start[i], a->end[i], hits)) return 0;
+  }
+  unionRanges(hits);
+  return 1;
+}
+
+// analyze mode: index every patch, then report the ranges written by more than one
+// patch, coverage statistics and the records written past the end of the source ROM
+// (when one is given). returns 1 when some patches conflict, -1 on errors
+int analyzePatches(const char **patchNames, int patchCount, const char *romName) {
+  intervalIndex **indexes = NULL;
+  rangeList hits = { NULL, 0, 0 }, all = { NULL, 0, 0 };
+  struct stat romStats;
+  patchSet *set;
+  uint64_t romSize = 0, written, inRom = 0;
+  uint32_t rleCount, pastEnd, firstPastEnd, conflicts = 0, i;
+  int p, q, ret = -1;
+
+  if (romName) {
+    if (stat(romName, &romStats) != 0) {
+      printf("Cannot Open File [%s]\n", romName);
+      return -1;
+    }
+    romSize = (uint64_t)romStats.st_size;
+    printf("[ANALYZE] Source ROM: [%s] (%llu bytes)\n", romName, (unsigned long long)romSize);
+  }
+  indexes = (intervalIndex **)calloc(patchCount, sizeof(intervalIndex *));
+  if (!indexes) return -1;
+
+  // load and index every patch, the patch itself is released once indexed
+  for (p = 0; p < patchCount; p++) {
+    set = readPatchFile(patchNames[p]);
+    if (!set) {
+      printf("[%s] Cannot Load Patches from IPS File.\n", patchNames[p]);
+      goto cleanup;
+    }
+    indexes[p] = buildIndex(set);
+    if (!indexes[p]) {
+      destroy(set);
+      goto cleanup;
+    }
+
+    rleCount = 0; pastEnd = 0; firstPastEnd = 0;
+    hits.count = 0;
+    for (i = 0; i < count(set); i++) {
+      if (set->records[i].rle) rleCount++;
+      if (romName && (set->records[i].offset + set->records[i].size > romSize)) {
+        if (pastEnd++ == 0) firstPastEnd = set->records[i].offset;
+      }
+    }
+    for (i = 0; i < indexes[p]->count; i++) {
+      if (!pushRange(&hits, indexes[p]->start[i], indexes[p]->end[i]) ||
+          !pushRange(&all, indexes[p]->start[i], indexes[p]->end[i])) {
+        destroy(set);
+        goto cleanup;
+      }
+    }
+    written = unionRanges(&hits);
+    printf("[ANALYZE] %s: %u records (%u RLE), %llu bytes written, span 0x%06X-0x%06X\n", patchNames[p],
+           count(set), rleCount, (unsigned long long)written, indexes[p]->spanStart, indexes[p]->spanEnd);
+    if (set->fileOrder) printf("[ANALYZE] %s: records overlap inside the patch (the last one wins)\n", patchNames[p]);
+    if (set->truncate) printf("[ANALYZE] %s: truncates the ROM to %u bytes\n", patchNames[p], set->truncateSize);
+    if (pastEnd) printf("[ANALYZE] %s: %u records write past the end of the source ROM (first @offset: 0x%06X)\n", patchNames[p], pastEnd, firstPastEnd);
+    destroy(set);
+  }
+
+  // pairwise conflicts
+  for (p = 0; p < patchCount; p++) {
+    for (q = p + 1; q < patchCount; q++) {
+      if (!indexOverlap(indexes[p], indexes[q], &hits)) goto cleanup;
+      if (hits.count == 0) continue;
+      conflicts++;
+      written = 0;
+      for (i = 0; i < hits.count; i++) written += hits.ranges[i].end - hits.ranges[i].start;
+      printf("[CONFLICT] %s <-> %s: %u ranges, %llu bytes\n", patchNames[p], patchNames[q], hits.count, (unsigned long long)written);
+      for (i = 0; (i < hits.count) && (i < IPS_ANALYZE_MAX_RANGES); i++) {
+        printf("    0x%06X-0x%06X (%u bytes)\n", hits.ranges[i].start, hits.ranges[i].end, hits.ranges[i].end - hits.ranges[i].start);
+      }
+      if (hits.count > IPS_ANALYZE_MAX_RANGES) printf("    ... %u more ranges\n", hits.count - IPS_ANALYZE_MAX_RANGES);
+    }
+  }
+
+  // coverage of all patches together
+  written = unionRanges(&all);
+  printf("[ANALYZE] %d patches, %llu bytes written", patchCount, (unsigned long long)written);
+  if (romName && romSize) {
+    for (i = 0; (i < all.count) && (all.ranges[i].start < romSize); i++) {
+      inRom += ((all.ranges[i].end < romSize) ? all.ranges[i].end : romSize) - all.ranges[i].start;
+    }
+    printf(" (%.2f%% of the source ROM)", 100.0 * (double)inRom / (double)romSize);
+  }
+  printf(", %u conflicting pairs.\n", conflicts);
+  ret = (conflicts > 0) ? 1 : 0;
+
+cleanup:
+  for (p = 0; p < patchCount; p++) freeIndex(indexes[p]);
+  free(indexes);
+  if (hits.ranges) free(hits.ranges);
+  if (all.ranges) free(all.ranges);
+  return ret;
+}
+
+// PATCHING MODES
+// load the source ROM in memory, patch it and write the destination in one go.
+// the outcome is also stored in status (when not NULL) as a static string
+int patchInMemory(FILE *srcRom, patchSet *patches, const char *destName, patchOptions *options, const char **status) {
+  romImage *rom = NULL;
+  patchSet *undo = NULL;
+  uint8_t *bitmap = NULL;
+  checksumFix checksum;
+  const char *outcome = "PATCHED";
+  size_t sourceSize;
+  int ret = 0;
+
+  rom = loadRom(srcRom, patches->maxEnd, romHeader(fileno(srcRom), options->headerMode));
+  bitmap = (uint8_t *)malloc(BITMAP_BYTES(count(patches)) + 1);
+  if (!rom || !bitmap) {
+    LOG("Cannot Load ROM File\n");
+    freeRom(rom);
+    if (bitmap) free(bitmap);
+    if (status) *status = "CANNOT LOAD ROM";
+    return -1;
+  }
+
+  // check patch status
+  if (reportVerify(rom, patches, bitmap, verifyPatch(rom, patches, bitmap))) {
+    LOG("[PATCH VALIDATION] Source ROM Already Patched.\n");
+    outcome = "ALREADY PATCHED";
+  } else {
+    // apply the missing records in memory, then write the destination ROM in one go
+    sourceSize = rom->size;
+    detectChecksum(rom, options->checksumMode, &checksum);
+    if (!applyPatch(rom, patches, bitmap, options->threads, options->undoName ? &undo : NULL, (checksum.kind != CHECKSUM_NONE) ? &checksum : NULL) || !writeRom(rom, destName, options->stripHeader)) {
+      LOG("Cannot Write File [%s]\n", destName);
+      outcome = "CANNOT WRITE DESTINATION";
+      ret = -1;
+    } else if (options->undoName && !writeUndo(rom, undo, options->undoName, sourceSize)) {
+      LOG("Cannot Write Undo Patch [%s]\n", options->undoName);
+      outcome = "CANNOT WRITE UNDO PATCH";
+      ret = -1;
+    }
+  }
+
+  destroy(undo);
+  free(bitmap);
+  freeRom(rom);
+  if (status) *status = outcome;
+  return ret;
+}
+
+// copy-on-write patching: clone the source ROM (reflink when the filesystem
+// supports it) and write only the patched ranges to the clone. A stripped copier
+// header is simply not copied
+int patchClone(FILE *srcRom, patchSet *patches, const char *destName, patchOptions *options, const char **status) {
+  romImage *source = NULL, *destination = NULL;
+  patchSet *undo = NULL;
+  uint8_t *bitmap = NULL;
+  checksumFix checksum;
+  const char *method = NULL;
+  const char *outcome = "CANNOT WRITE DESTINATION";
+  int destFd, ret = -1;
+
+  source = fileRom(fileno(srcRom), romHeader(fileno(srcRom), options->headerMode));
+  bitmap = (uint8_t *)malloc(BITMAP_BYTES(count(patches)) + 1);
+  if (!source || !bitmap) {
+    LOG("Cannot Load ROM File\n");
+    freeRom(source);
+    if (bitmap) free(bitmap);
+    if (status) *status = "CANNOT LOAD ROM";
+    return -1;
+  }
+
+  // check patch status, reading only the patched ranges
+  if (reportVerify(source, patches, bitmap, verifyPatch(source, patches, bitmap))) {
+    LOG("[PATCH VALIDATION] Source ROM Already Patched.\n");
+    free(bitmap);
+    freeRom(source);
+    if (status) *status = "ALREADY PATCHED";
+    return 0;
+  }
+
+  destFd = open(destName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (destFd < 0) {
+    LOG("Cannot Open File [%s]\n", destName);
+    free(bitmap);
+    freeRom(source);
+    if (status) *status = "CANNOT OPEN DESTINATION";
+    return -1;
+  }
+
+  if (options->stripHeader) {
+    method = cloneFile(fileno(srcRom), destFd, source->base, source->size);
+  } else {
+    method = cloneFile(fileno(srcRom), destFd, 0, source->base + source->size);
+  }
+  if (!method) {
+    LOG("Cannot Clone ROM File [%s]\n", destName);
+    outcome = "CANNOT CLONE ROM";
+  } else {
+    LOG("[CLONE] Destination ROM created with %s.\n", method);
+    // several threads write to a shared mapping of the clone, a single one uses pwrite
+    if (options->threads > 1) destination = mapRomShared(destFd, options->stripHeader ? 0 : source->base, patches->maxEnd);
+    if (!destination) destination = fileRom(destFd, options->stripHeader ? 0 : source->base);
+    detectChecksum(source, options->checksumMode, &checksum);
+    if (!destination || !applyPatch(destination, patches, bitmap, options->threads, options->undoName ? &undo : NULL, (checksum.kind != CHECKSUM_NONE) ? &checksum : NULL)) {
+      LOG("Cannot Write File [%s]\n", destName);
+    } else if (options->undoName && !writeUndo(destination, undo, options->undoName, source->size)) {
+      LOG("Cannot Write Undo Patch [%s]\n", options->undoName);
+      outcome = "CANNOT WRITE UNDO PATCH";
+    } else {
+      outcome = "PATCHED";
+      ret = 0;
+    }
+  }
+
+  destroy(undo);
+  free(bitmap);
+  freeRom(destination);
+  freeRom(source);
+  close(destFd);
+  if (status) *status = outcome;
+  return ret;
+}
+
+// PATCHED VIEW
+// open a view of the source ROM patched with a normalized patch set. the ROM file
+// stays owned by the caller and must stay open while the view is used
+patchedView *openView(int romFd, patchSet *patches, patchOptions *options) {
+  patchedView *view;
+  size_t size;
+
+  if (patches->fileOrder) return NULL;
+  view = (patchedView *)calloc(1, sizeof(struct PATCHED_VIEW));
+  if (!view) return NULL;
+  view->source = fileRom(romFd, romHeader(romFd, options->headerMode));
+  if (!view->source) {
+    free(view);
+    return NULL;
+  }
+  view->patches = patches;
+  view->base = options->stripHeader ? 0 : view->source->base;
+
+  size = patchedSize(patches, view->source->size);
+  view->size = view->base + size;
+  return view;
+}
+
+void closeView(patchedView *view) {
+  if (!view) return;
+  freeRom(view->source);
+  free(view);
+}
+
+// read up to length bytes of the patched ROM at offset: one pread of the source bytes
+// (zeros past the end of the source), then the records found by binary search are
+// copied over. returns the number of bytes read, 0 at the end of the ROM or on errors
+size_t readPatched(patchedView *view, size_t offset, uint8_t *buffer, size_t length) {
+  recordEntry *r;
+  size_t end, sourceEnd, copied, start, stop, from, to;
+  uint32_t lo, hi, mid;
+
+  if (offset >= view->size) return 0;
+  if (length > view->size - offset) length = view->size - offset;
+  end = offset + length;
+
+  // source bytes, the file is contiguous from the (kept) header to the end of the ROM
+  sourceEnd = view->base + view->source->size;
+  copied = (end < sourceEnd) ? end : sourceEnd;
+  if (offset < copied) {
+    if (!preadAll(view->source->fd, buffer, copied - offset, (off_t)(view->source->base - view->base + offset))) return 0;
+  } else {
+    copied = offset;
+  }
+  memset(buffer + (copied - offset), 0, end - copied);
+  if (end <= view->base) return length;
+
+  // records are sorted and do not overlap: their ends are sorted too, so the first
+  // record ending after the start of the read is found by binary search
+  start = (offset > view->base) ? offset - view->base : 0;
+  stop = end - view->base;
+  lo = 0; hi = count(view->patches);
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    r = &view->patches->records[mid];
+    if ((size_t)r->offset + r->size <= start) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (; (lo < count(view->patches)) && (view->patches->records[lo].offset < stop); lo++) {
+    r = &view->patches->records[lo];
+    from = (r->offset > start) ? r->offset : start;
+    to = ((size_t)r->offset + r->size < stop) ? (size_t)r->offset + r->size : stop;
+    if (r->rle) {
+      memset(buffer + (view->base + from - offset), r->byte_val, to - from);
+    } else {
+      memcpy(buffer + (view->base + from - offset), RECORD_DATA(view->patches, r) + (from - r->offset), to - from);
+    }
+  }
+  return length;
+}
+
+// cat mode: write a range of the patched ROM ("start[:length]", the whole ROM when NULL)
+// to stdout. stdout carries the ROM bytes, messages go to stderr
+int catPatched(const char *romName, const char **patchNames, int patchCount, const char *range, patchOptions *options) {
+  patchSet *sets[IPS_MAX_PATCHES], *patches = NULL;
+  patchedView *view = NULL;
+  uint8_t *buffer = NULL;
+  unsigned long long start = 0, length = ULLONG_MAX;
+  char *next;
+  size_t chunk;
+  int romFd = -1, loaded = 0, p, ret = -1;
+
+  if (range) {
+    start = strtoull(range, &next, 0);
+    if (*next == ':') length = strtoull(next + 1, &next, 0);
+    if ((*next != '\0') || (next == range)) {
+      fprintf(stderr, "[r option] : Range must be start[:length].\n");
+      return -1;
+    }
+  }
+
+  for (p = 0; p < patchCount; p++) {
+    sets[p] = readPatchFile(patchNames[p]);
+    if (!sets[p]) {
+      fprintf(stderr, "[%s] Cannot Load Patches from IPS File.\n", patchNames[p]);
+      goto cleanup;
+    }
+    loaded++;
+  }
+  // the view needs sorted, non-overlapping records
+  if ((patchCount > 1) || sets[0]->fileOrder) {
+    patches = mergePatches(sets, patchCount);
+  } else {
+    patches = sets[0];
+    loaded = 0;
+  }
+  if (!patches) {
+    fprintf(stderr, "Cannot Merge IPS Patches.\n");
+    goto cleanup;
+  }
+  romFd = open(romName, O_RDONLY);
+  buffer = (uint8_t *)malloc(IPS_VIEW_CHUNK);
+  if ((romFd >= 0) && buffer) view = openView(romFd, patches, options);
+  if (!view) {
+    fprintf(stderr, "Cannot Open File [%s]\n", romName);
+    goto cleanup;
+  }
+
+  if (start < view->size) {
+    if (length > view->size - start) length = view->size - start;
+    while (length > 0) {
+      chunk = readPatched(view, start, buffer, (length < IPS_VIEW_CHUNK) ? length : IPS_VIEW_CHUNK);
+      if ((chunk == 0) || (fwrite(buffer, chunk, 1, stdout) != 1)) goto cleanup;
+      start += chunk;
+      length -= chunk;
+    }
+  }
+  ret = (fflush(stdout) == 0) ? 0 : -1;
+
+cleanup:
+  closeView(view);
+  if (buffer) free(buffer);
+  if (romFd >= 0) close(romFd);
+  for (p = 0; p < loaded; p++) destroy(sets[p]);
+  destroy(patches);
+  return ret;
+}
+
+// BATCH PATCHING
+double elapsedSeconds(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// worker thread: run jobs until the manifest is exhausted
+void *batchWorker(void *arg) {
+  batchRun *run = (batchRun *)arg;
+  batchJob *job;
+  struct timespec start;
+  FILE *srcRom;
+  uint32_t i;
+
+  while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count) {
+    job = &run->jobs[i];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!job->patch) {
+      job->status = "CANNOT LOAD PATCH";
+      job->result = -1;
+    } else if (!(srcRom = fopen(job->romName, "r"))) {
+      job->status = "CANNOT OPEN ROM";
+      job->result = -1;
+    } else {
+      if (run->cloneDestination) {
+        job->result = patchClone(srcRom, job->patch, job->destName, run->options, &job->status);
+      } else {
+        job->result = patchInMemory(srcRom, job->patch, job->destName, run->options, &job->status);
+      }
+      fclose(srcRom);
+    }
+    job->seconds = elapsedSeconds(&start);
+  }
+  return NULL;
+}
+
+int compareJobPatches(const void *a, const void *b) {
+  return strcmp((*(batchJob * const *)a)->patchName, (*(batchJob * const *)b)->patchName);
+}
+
+// read the manifest: one "rom patch output" job per line, blank lines and '#' comments skipped
+batchJob *readManifest(const char *manifestName, uint32_t *jobCount) {
+  FILE *manifest;
+  batchJob *jobs = NULL, *grown;
+  char *line = NULL, *fields[3], *save;
+  size_t lineSize = 0;
+  uint32_t capacity = 0, lineNumber = 0;
+  int f, ok = 1;
+
+  *jobCount = 0;
+  manifest = fopen(manifestName, "r");
+  if (!manifest) {
+    printf("Cannot Open File [%s]\n", manifestName);
+    return NULL;
+  }
+  while (ok && (getline(&line, &lineSize, manifest) != -1)) {
+    lineNumber++;
+    fields[0] = strtok_r(line, " \t\r\n", &save);
+    if (!fields[0] || (fields[0][0] == '#')) continue;
+    for (f = 1; f < 3; f++) fields[f] = strtok_r(NULL, " \t\r\n", &save);
+    if (!fields[1] || !fields[2]) {
+      printf("[BATCH] %s:%u: expected \"rom patch output\".\n", manifestName, lineNumber);
+      ok = 0;
+      break;
+    }
+    if (*jobCount == capacity) {
+      capacity = capacity ? capacity * 2 : IPS_INITIAL_RECORDS;
+      grown = (batchJob *)realloc(jobs, capacity * sizeof(struct BATCH_JOB));
+      if (!grown) {
+        ok = 0;
+        break;
+      }
+      jobs = grown;
+    }
+    memset(&jobs[*jobCount], 0, sizeof(struct BATCH_JOB));
+    jobs[*jobCount].romName = strdup(fields[0]);
+    jobs[*jobCount].patchName = strdup(fields[1]);
+    jobs[*jobCount].destName = strdup(fields[2]);
+    jobs[*jobCount].status = "NOT RUN";
+    (*jobCount)++;
+    if (!jobs[*jobCount - 1].romName || !jobs[*jobCount - 1].patchName || !jobs[*jobCount - 1].destName) ok = 0;
+  }
+  if (line) free(line);
+  fclose(manifest);
+  if (!ok || (*jobCount == 0)) {
+    if (ok) printf("[BATCH] %s: no jobs.\n", manifestName);
+    while (*jobCount > 0) {
+      (*jobCount)--;
+      free(jobs[*jobCount].romName);
+      free(jobs[*jobCount].patchName);
+      free(jobs[*jobCount].destName);
+    }
+    if (jobs) free(jobs);
+    return NULL;
+  }
+  return jobs;
+}
+
+// batch mode: run every job of the manifest on a pool of threads, then report the
+// status and time of each job. returns 1 when some jobs failed, -1 on errors
+int batchPatch(const char *manifestName, int threads, int cloneDestination, patchOptions *options) {
+  batchRun run;
+  batchJob **byPatch = NULL;
+  pthread_t *workers = NULL;
+  patchSet **patches = NULL, *merged;
+  struct timespec start;
+  uint32_t i, uniqueCount = 0, done = 0, already = 0, failed = 0;
+  double jobSeconds = 0;
+  int t, started = 0, ret = -1;
+
+  memset(&run, 0, sizeof(run));
+  run.cloneDestination = cloneDestination;
+  run.options = options;
+  options->threads = 1;
+  options->undoName = NULL;
+  run.jobs = readManifest(manifestName, &run.count);
+  if (!run.jobs) return -1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // parse every unique patch once (overlapping records are normalized up front)
+  byPatch = (batchJob **)malloc(run.count * sizeof(batchJob *));
+  patches = (patchSet **)calloc(run.count, sizeof(patchSet *));
+  workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  if (!byPatch || !patches || !workers) goto cleanup;
+  for (i = 0; i < run.count; i++) byPatch[i] = &run.jobs[i];
+  qsort(byPatch, run.count, sizeof(batchJob *), compareJobPatches);
+  for (i = 0; i < run.count; i++) {
+    if ((i > 0) && (strcmp(byPatch[i]->patchName, byPatch[i - 1]->patchName) == 0)) {
+      byPatch[i]->patch = byPatch[i - 1]->patch;
+      continue;
+    }
+    byPatch[i]->patch = readPatchFile(byPatch[i]->patchName);
+    if (byPatch[i]->patch && byPatch[i]->patch->fileOrder) {
+      merged = mergePatches(&byPatch[i]->patch, 1);
+      destroy(byPatch[i]->patch);
+      byPatch[i]->patch = merged;
+    }
+    if (byPatch[i]->patch) patches[uniqueCount++] = byPatch[i]->patch;
+  }
+  printf("[BATCH] %u jobs, %u unique patches, %d threads.\n", run.count, uniqueCount, threads);
+
+  // the patching functions stay quiet in the workers, each job reports its outcome
+  verbose = 0;
+  for (t = 0; t < threads; t++) {
+    if (pthread_create(&workers[t], NULL, batchWorker, &run) != 0) break;
+    started++;
+  }
+  // no thread at all: run the jobs here
+  if (started == 0) batchWorker(&run);
+  for (t = 0; t < started; t++) pthread_join(workers[t], NULL);
+  verbose = 1;
+
+  // per job report, in manifest order
+  for (i = 0; i < run.count; i++) {
+    printf("[JOB %u] %s + %s -> %s: %s (%.2f ms)\n", i + 1, run.jobs[i].romName, run.jobs[i].patchName,
+           run.jobs[i].destName, run.jobs[i].status, run.jobs[i].seconds * 1000.0);
+    jobSeconds += run.jobs[i].seconds;
+    if (run.jobs[i].result != 0) {
+      failed++;
+    } else if (strcmp(run.jobs[i].status, "ALREADY PATCHED") == 0) {
+      already++;
+    } else {
+      done++;
+    }
+  }
+  printf("[BATCH] Complete: %u patched, %u already patched, %u failed in %.3f s (%.3f s of jobs).\n",
+         done, already, failed, elapsedSeconds(&start), jobSeconds);
+  ret = (failed > 0) ? 1 : 0;
+
+cleanup:
+  for (i = 0; i < uniqueCount; i++) destroy(patches[i]);
+  for (i = 0; i < run.count; i++) {
+    free(run.jobs[i].romName);
+    free(run.jobs[i].patchName);
+    free(run.jobs[i].destName);
+  }
+  free(run.jobs);
+  if (byPatch) free(byPatch);
+  if (patches) free(patches);
+  if (workers) free(workers);
+  return ret;
+}
+
+// open, validate and load an IPS patch file
+patchSet *openPatch(const char *patchFileName) {
+  patchSet *set = NULL;
+  FILE *patch = NULL;
+
+  patch = openFile(patchFileName);
+  if (!patch) {
+    printf("Cannot Open File [%s]\n", patchFileName);
+    return NULL;
+  }
+  if (!checkValidPatch(patch)) {
+    printf("[%s] Patch File Is Invalid.\n", patchFileName);
+  } else {
+    // load patch entries (the mapping outlives the file handle)
+    set = loadIpsPatch(patch);
+    if (!set) {
+      printf("[%s] Cannot Load Patches from IPS File.\n", patchFileName);
+    } else {
+      printf("[INFO]: File Contains %d unique byte patches\n", count(set));
+    }
+  }
+  closeFile(patch);
+  return set;
+}
+
+// MAIN FUNCTION
+int main(int argc, char **argv) {
+  // local vars
+  unsigned int opt;
+  unsigned char *patchFileNames[IPS_MAX_PATCHES];
+  unsigned char *sourceRomFileName = NULL;
+  unsigned char *destinationRomFileName = NULL;
+  unsigned char *flatPatchFileName = NULL;
+  patchSet *patchSets[IPS_MAX_PATCHES];
+  patchSet *patchHead = NULL;
+  const char *mode = "apply";
+  const char **analyzeNames = NULL;
+  const char *manifestFileName = NULL;
+  const char *range = NULL;
+  int threads = 0;
+  patchOptions options = { HEADER_AUTO, 0, 1, NULL, CHECKSUM_NONE };
+  int patchCount = 0, i;
+  int cloneDestination = 0;
+  int exitCode = 0;
+  // file descriptors
+  FILE *srcRom = NULL;
+
+  // parse command line options
+  while ((opt = getopt(argc, argv, "i:d:p:m:o:b:j:H:r:u:k:sc?")) != -1) {
+    switch (opt) {
+      case 'i':
+        sourceRomFileName = (unsigned char *)optarg;
+        break;
+      case 'd':
+        destinationRomFileName = (unsigned char *)optarg;
+        break;
+      case 'p':
+        // patches are applied in command line order
+        if (patchCount == IPS_MAX_PATCHES) {
+          printf("[p option] : Too many IPS Patch Files (max %d).\n", IPS_MAX_PATCHES);
+          exit(-1);
+        }
+        patchFileNames[patchCount++] = (unsigned char *)optarg;
+        break;
+      case 'o':
+        flatPatchFileName = (unsigned char *)optarg;
+        break;
+      case 'c':
+        cloneDestination = 1;
+        break;
+      case 'm':
+        mode = optarg;
+        break;
+      case 'b':
+        manifestFileName = optarg;
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'H':
+        if (strcmp(optarg, "auto") == 0) {
+          options.headerMode = HEADER_AUTO;
+        } else if (strcmp(optarg, "on") == 0) {
+          options.headerMode = HEADER_ON;
+        } else if (strcmp(optarg, "off") == 0) {
+          options.headerMode = HEADER_OFF;
+        } else {
+          printf("[H option] : Copier header mode must be auto, on or off.\n");
+          exit(-1);
+        }
+        break;
+      case 's':
+        options.stripHeader = 1;
+        break;
+      case 'r':
+        range = optarg;
+        break;
+      case 'u':
+        options.undoName = optarg;
+        break;
+      case 'k':
+        if (strcmp(optarg, "auto") == 0) {
+          options.checksumMode = CHECKSUM_AUTO;
+        } else if (strcmp(optarg, "md") == 0) {
+          options.checksumMode = CHECKSUM_MD;
+        } else if (strcmp(optarg, "snes") == 0) {
+          options.checksumMode = CHECKSUM_SNES;
+        } else {
+          printf("[k option] : Checksum fix-up mode must be auto, md or snes.\n");
+          exit(-1);
+        }
+        break;
+      case '?':
+        if (optopt == 'i') {
+          printf("[i option] : Input ROM File Name is a mandatory option: please specify a ROM File Name.\n");
+        } else if (optopt == 'd') {
+          printf("[d option] : Destination ROM File Name is missing: please specify a Destination ROM File Name.\n");
+        } else if (optopt == 'p') {
+          printf("[p option] : Missing IPS Patch File Name: Cannot patch anything without one.\n");
+        } else {
+          printf("Bad Option Detected: %c\n", optopt);
+        }
+        exit(-1);
+    }
+  }
+
+  // batch mode: jobs from the manifest, one thread per CPU unless -j is given
+  if (strcmp(mode, "batch") == 0) {
+    if (!manifestFileName) {
+      printf("[b option] : Missing Manifest File Name.\n");
+      exit(-1);
+    }
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    // jobs run side by side, each one is applied by a single thread
+    exit(batchPatch(manifestFileName, threads, cloneDestination, &options));
+  }
+
+  // cat mode: the patched ROM (or a range of it) is written to stdout
+  if (strcmp(mode, "cat") == 0) {
+    if ((patchCount == 0) || (sourceRomFileName == NULL)) {
+      fprintf(stderr, "Missing input parameters.\n");
+      exit(-1);
+    }
+    verbose = 0;
+    exit(catPatched((const char *)sourceRomFileName, (const char **)patchFileNames, patchCount, range, &options));
+  }
+
+  // analyze mode: patches from -p and from the remaining arguments, -i is optional
+  if (strcmp(mode, "analyze") == 0) {
+    analyzeNames = (const char **)malloc((patchCount + argc - optind + 1) * sizeof(char *));
+    if (!analyzeNames) exit(-1);
+    for (i = 0; i < patchCount; i++) analyzeNames[i] = (const char *)patchFileNames[i];
+    while (optind < argc) analyzeNames[i++] = argv[optind++];
+    if (i == 0) {
+      printf("Missing input parameters.\n");
+      exit(-1);
+    }
+    exitCode = analyzePatches(analyzeNames, i, (const char *)sourceRomFileName);
+    free(analyzeNames);
+    exit(exitCode);
+  }
+
+  // apply mode: -j threads patch each ROM
+  if (threads > 0) options.threads = threads;
+
+  // sanity check
+  if ((patchCount == 0) || (((sourceRomFileName == NULL) || (destinationRomFileName == NULL)) && (flatPatchFileName == NULL || (strcmp(mode, "apply") != 0 && strcmp(mode, "compile") != 0)))) {
+    printf("Missing input parameters.\n");
+    exit(-1);
+  }
+
+  // create mode: -i original ROM, -d modified ROM, -p patch to write
+  if (strcmp(mode, "create") == 0) {
+    printf("Original ROM: [%s]\nModified ROM: [%s]\nPatch File: [%s]\n", sourceRomFileName, destinationRomFileName, patchFileNames[0]);
+    exit(createPatch((const char *)sourceRomFileName, (const char *)destinationRomFileName, (const char *)patchFileNames[0], options.headerMode));
+  } else if ((strcmp(mode, "apply") != 0) && (strcmp(mode, "compile") != 0)) {
+    printf("Unknown Mode: %s\n", mode);
+    exit(-1);
+  }
+  for (i = 0; i < patchCount; i++) printf("Patch File: [%s]\n", patchFileNames[i]);
+  if (sourceRomFileName) printf("Source ROM: [%s]\nDestination ROM: [%s]\n", sourceRomFileName, destinationRomFileName);
+
+  // load IPS Patches
+  for (i = 0; i < patchCount; i++) {
+    patchSets[i] = openPatch((const char *)patchFileNames[i]);
+    if (!patchSets[i]) {
+      while (--i >= 0) destroy(patchSets[i]);
+      exit(-1);
+    }
+  }
+
+  // stacked patches (or a patch with overlapping records) are merged into one
+  // normalized set, applied in a single pass
+  if ((patchCount > 1) || patchSets[0]->fileOrder) {
+    patchHead = mergePatches(patchSets, patchCount);
+    for (i = 0; i < patchCount; i++) destroy(patchSets[i]);
+    if (!patchHead) {
+      printf("Cannot Merge IPS Patches.\n");
+      exit(-1);
+    }
+    printf("[MERGE] %d patch(es) merged into %u records.\n", patchCount, count(patchHead));
+  } else {
+    patchHead = patchSets[0];
+  }
+
+  // flattened (or compiled) patch
+  if (flatPatchFileName) {
+    if (strcmp(mode, "compile") == 0) {
+      if (!writeCompiledPatch(patchHead, (const char *)flatPatchFileName)) {
+        printf("Cannot Write File [%s]\n", flatPatchFileName);
+        destroy(patchHead);
+        exit(-1);
+      }
+      printf("[COMPILE] Compiled patch written to [%s].\n", flatPatchFileName);
+    } else if (!writeIpsPatch(patchHead, (const char *)flatPatchFileName, NULL, 0)) {
+      printf("Cannot Write File [%s]\n", flatPatchFileName);
+      destroy(patchHead);
+      exit(-1);
+    } else {
+      printf("[MERGE] Flattened patch written to [%s].\n", flatPatchFileName);
+    }
+    if (!sourceRomFileName || !destinationRomFileName) {
+      destroy(patchHead);
+      exit(0);
+    }
+  }
+
+  // load source rom
+  srcRom = openFile((const char *)sourceRomFileName);
+  if (!srcRom) {
+    printf("Cannot Open File [%s]\n", sourceRomFileName);
+    destroy(patchHead);
+    exit(-1);
+  }
+
+  // patch a copy of the source ROM
+  if (cloneDestination) {
+    exitCode = patchClone(srcRom, patchHead, (const char *)destinationRomFileName, &options, NULL);
+  } else {
+    exitCode = patchInMemory(srcRom, patchHead, (const char *)destinationRomFileName, &options, NULL);
+  }
+  destroy(patchHead);
+
+  // closeup and exit
+  if (srcRom) closeFile(srcRom);
+  exit(exitCode);
+}
@@ -4,14 +4,18 @@
 //
 // v0.1 - 05/02/25
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
 // IPS Patch Magic Bytes
 // IPS Patch files start with a 5-bytes header containing the literal
@@ -40,22 +44,276 @@ union IPS_RECORD_HEADER {
   };
 };
 
-// this structure holds a patch entry
-// - the patch header
-// - the patch bytes
-// - pointer to the next patch
+// RLE record body, stored after a record header with size 0
+struct IPS_RLE_RECORD {
+  uint8_t length[2];
+  uint8_t byte_val;
+};
 typedef union IPS_RECORD_HEADER recordHeader;
+typedef struct IPS_RLE_RECORD rleHeader;
+
+// this structure holds a decoded patch entry
+// - offset and size in host byte order
+// - position of the payload bytes in the patch set payload area
+// - position of the record in the patch file (IPS is last-writer-wins)
 struct IPS_PATCH_RECORD {
-  recordHeader *r;
-  struct {
-    uint8_t length[2];
-    uint8_t byte_val;
-  } rle;
-  uint8_t *patchValue;
-  struct IPS_PATCH_RECORD *next;
+  uint32_t offset;
+  uint32_t size;      // bytes to patch (run length for RLE records)
+  uint32_t data;      // payload position (literal records only)
+  uint32_t seq;
+  uint8_t rle;
+  uint8_t byte_val;   // RLE byte value
+  uint8_t reserved[2];
 };
 typedef struct IPS_PATCH_RECORD recordEntry;
 
+// a whole patch: one flat array of records sorted by offset.
+// payloads are not copied: they are read in place from the memory mapped
+// patch file (or from an arena, for patches built in memory)
+struct IPS_PATCH_SET {
+  recordEntry *records;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t *fileOrder;    // record indexes in file order, only set when records overlap
+  uint32_t maxEnd;        // end offset of the furthest record
+  uint8_t truncate;       // the patch carries the truncation extension (3 bytes after EOF)
+  uint32_t truncateSize;
+  const uint8_t *payload; // payload area (file mapping or arena)
+  uint8_t *arena;
+  size_t arenaSize;
+  size_t arenaUsed;
+  void *mapping;          // memory mapped patch file
+  size_t mappingSize;
+  uint8_t compiled;       // records are read in place from a compiled patch mapping
+};
+typedef struct IPS_PATCH_SET patchSet;
+
+// Compiled Patches
+// a patch set saved as it is held in memory, to be mapped and used without parsing:
+// - header (native byte order)
+// - normalized record array (sorted, non-overlapping), 8-byte aligned
+// - literal payloads packed contiguously in record order
+// the checksum (CRC-32) covers the header and the record array, so a damaged index is
+// rejected with one pass over the records, which also checks that every record lies inside
+// maxEnd and the payload (a well checksummed but malformed file is rejected as well);
+// payload bytes are not checked at load time
+#define IPSC_MAGIC_TAG "IPSC"
+#define IPSC_MAGIC_SIZE 4
+#define IPSC_VERSION 1
+#define IPSC_BYTE_ORDER 0x01020304  // written natively, reads differently on another endianness
+#define IPSC_TRUNCATE 0x1
+
+struct IPS_COMPILED_HEADER {
+  char magic[IPSC_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t recordCount;
+  uint32_t flags;
+  uint32_t maxEnd;
+  uint32_t truncateSize;
+  uint32_t checksum;        // computed with this field set to 0
+  uint64_t recordsOffset;
+  uint64_t payloadOffset;
+  uint64_t payloadSize;
+  uint8_t reserved[8];
+};
+typedef struct IPS_COMPILED_HEADER compiledHeader;
+
+// ROM image being patched
+// - held in memory: capacity is reserved up front for records extending past the end of the source ROM
+// - or file backed (data is NULL): records are read and written in place with pread/pwrite
+// - offsets are relative to the ROM data: a copier header (base bytes) stays in front of
+//   the image, in memory data points right after it, in files it is skipped on every access
+struct ROM_IMAGE {
+  uint8_t *data;
+  size_t size;        // without the header
+  size_t capacity;
+  size_t base;        // copier header size
+  int fd;             // file backed images only, -1 otherwise
+  uint8_t mapped;     // data is a read-only mapping of the ROM file
+};
+typedef struct ROM_IMAGE romImage;
+
+// Copier Headers
+// headered dumps (SNES .smc/.swc/.fig...) carry a 512-byte copier header that IPS offsets
+// do not count. Auto mode reports one when the file size modulo 1024 is exactly 512.
+#define IPS_HEADER_SIZE 512
+enum HEADER_MODE { HEADER_AUTO, HEADER_ON, HEADER_OFF };
+
+// Checksum Fix-up
+// the header checksum of Mega Drive and SNES ROMs is updated incrementally: each byte a
+// record replaces changes the checksummed sum by weight * (new - old), the old bytes being
+// read right before they are overwritten. The stored checksum is assumed to be right.
+// - Mega Drive: big endian word at 0x18E, sum of the big endian words from 0x200
+// - SNES: complement then checksum (little endian words) at 0x7FDC (LoROM) or 0xFFDC (HiROM),
+//   sum of all bytes, a non power of two tail being mirrored to fill the last power of two
+enum CHECKSUM_MODE { CHECKSUM_NONE, CHECKSUM_AUTO, CHECKSUM_MD, CHECKSUM_SNES };
+#define MD_SYSTEM_OFFSET 0x100      // "SEGA MEGA DRIVE", "SEGA GENESIS"...
+#define MD_CHECKSUM_OFFSET 0x18E
+#define MD_CHECKSUM_START 0x200
+#define SNES_LOROM_CHECKSUM 0x7FDC
+#define SNES_HIROM_CHECKSUM 0xFFDC
+
+struct CHECKSUM_FIX {
+  int kind;             // CHECKSUM_MD, CHECKSUM_SNES, or CHECKSUM_NONE when there is nothing to fix
+  uint32_t offset;      // checksum word (SNES: complement word, the checksum follows)
+  uint32_t length;      // checksum bytes, left out of the sum
+  uint16_t stored;      // checksum of the source ROM
+  uint32_t delta;       // change of the checksummed sum (modulo 2^16)
+  uint32_t mirrorStart; // SNES: bytes from here are summed mirrorWeight times
+  uint32_t mirrorWeight;
+};
+typedef struct CHECKSUM_FIX checksumFix;
+
+// patching options shared by the patching modes
+struct PATCH_OPTIONS {
+  int headerMode;     // HEADER_AUTO, HEADER_ON or HEADER_OFF
+  int stripHeader;    // the destination ROM is written without the copier header
+  int threads;        // threads applying the records (in memory or mapped destinations)
+  const char *undoName; // undo patch captured while patching
+  int checksumMode;   // header checksum fix-up (CHECKSUM_NONE, CHECKSUM_AUTO, CHECKSUM_MD, CHECKSUM_SNES)
+};
+typedef struct PATCH_OPTIONS patchOptions;
+
+// Patch Stacking
+// several patches are merged into one set of non-overlapping, coalesced records:
+// every record is a merge item, the owner of each byte is the item with the highest
+// priority (later patch first, then later record in the same patch)
+struct MERGE_ITEM {
+  uint32_t start;
+  uint32_t end;
+  uint64_t priority;
+  patchSet *set;
+  recordEntry *record;
+};
+typedef struct MERGE_ITEM mergeItem;
+
+#define IPS_MAX_PATCHES 64
+
+// Patched View
+// byte ranges of the patched ROM served on the fly: the source ROM file is read and the
+// records of a normalized patch set (sorted, non-overlapping) are laid over it, nothing
+// is materialized. Reads share no state, a view can serve several threads at once
+struct PATCHED_VIEW {
+  romImage *source;   // file backed source ROM
+  patchSet *patches;
+  size_t base;        // copier header bytes served in front of the patched ROM
+  size_t size;        // size of the patched ROM, header included
+};
+typedef struct PATCHED_VIEW patchedView;
+
+// cat mode output buffer
+#define IPS_VIEW_CHUNK (1 << 20)
+
+// Interval Index
+// the offset-sorted records of a patch read as an implicit balanced binary search tree
+// (the root of [lo, hi) is its middle element), each node augmented with the furthest
+// end offset of its subtree: an overlap query visits O(log n + k) nodes.
+// only the ranges are kept, the patch itself can be released once indexed.
+struct INTERVAL_INDEX {
+  uint32_t *start;
+  uint32_t *end;
+  uint32_t *maxEnd;   // furthest end in the subtree rooted at each node
+  uint32_t count;
+  uint32_t spanStart; // bounds of the whole patch
+  uint32_t spanEnd;
+};
+typedef struct INTERVAL_INDEX intervalIndex;
+
+// a list of [start, end) offset ranges
+struct OFFSET_RANGE {
+  uint32_t start;
+  uint32_t end;
+};
+struct RANGE_LIST {
+  struct OFFSET_RANGE *ranges;
+  uint32_t count;
+  uint32_t capacity;
+};
+typedef struct RANGE_LIST rangeList;
+
+// conflicting ranges listed per pair of patches (the rest is only counted)
+#define IPS_ANALYZE_MAX_RANGES 8
+
+// Compare Kernels
+// byte compares used by the verifier, the fastest one supported by the CPU is picked at runtime
+// - matchLength: length of the common prefix of a and b
+// - runLength: length of the run of 'value' bytes at the start of a
+struct COMPARE_KERNEL {
+  const char *name;
+  size_t (*matchLength)(const uint8_t *a, const uint8_t *b, size_t n);
+  size_t (*runLength)(const uint8_t *a, uint8_t value, size_t n);
+};
+typedef struct COMPARE_KERNEL compareKernel;
+
+// Record Status Bitmap
+// one bit per record (offset order): set when the record bytes are already in the ROM
+#define BITMAP_BYTES(records) (((records) + 7) / 8)
+#define BITMAP_SET(bitmap, i) ((bitmap)[(i) >> 3] |= (uint8_t)(1 << ((i) & 7)))
+#define BITMAP_TEST(bitmap, i) (((bitmap)[(i) >> 3] >> ((i) & 7)) & 1)
+
+// Parallel Apply
+// the image is split in offset ranges holding about the same number of patched bytes,
+// each range is patched by its own thread: every thread walks the records in application
+// order and writes only the part of each record inside its range, so overlapping records
+// keep last-writer-wins order. Ranges get at least IPS_PARALLEL_MIN_BYTES bytes to write
+struct APPLY_RANGE {
+  romImage *rom;
+  patchSet *patches;
+  uint8_t *bitmap;
+  uint32_t start;
+  uint32_t end;
+};
+typedef struct APPLY_RANGE applyRange;
+
+#define IPS_PARALLEL_MIN_BYTES (1 << 20)
+#define IPS_MAX_THREADS 256
+
+// Console Output
+// progress messages of the patching functions, silenced when they run in batch workers
+extern int verbose;
+#define LOG(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+
+// Batch Patching
+// one job per manifest line (source ROM, patch, destination ROM). Every unique patch
+// is parsed once and shared read-only by the worker threads, which take the next job
+// with an atomic counter
+struct BATCH_JOB {
+  char *romName;
+  char *patchName;
+  char *destName;
+  patchSet *patch;
+  const char *status;   // outcome, static string
+  int result;
+  double seconds;
+};
+typedef struct BATCH_JOB batchJob;
+
+struct BATCH_RUN {
+  batchJob *jobs;
+  uint32_t count;
+  uint32_t next;        // next job to run
+  int cloneDestination;
+  patchOptions *options;
+};
+typedef struct BATCH_RUN batchRun;
+
+#define IPS_INITIAL_RECORDS 256
+#define IPS_EOF_OFFSET 0x454F46   // "EOF" read as a record offset: no record can start there
+#define IPS_MAX_OFFSET 0xFFFFFF   // 24-bit offsets
+
+// Patch Creation
+// a run of equal bytes inside a changed range becomes an RLE record when it is at least
+// as long as an RLE record plus the header of the literal record that follows it
+#define IPS_RLE_MIN_RUN 13
+// unchanged bytes that end a changed range: shorter gaps are cheaper to carry in the
+// payload than a new record header
+#define IPS_DIFF_GAP 6
+#define IPS_MAX_RECORD_SIZE 0xFFFF
+
+// payload bytes of a literal record
+#define RECORD_DATA(set, record) ((set)->payload + (record)->data)
+
 // IPS uses linear addresses, we need to rearrange bytes because of endianness
 // 16-bit values
 #define LINEAR_16(byte16_array) \
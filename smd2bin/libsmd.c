@@ -0,0 +1,992 @@
+//
+//  libsmd - SMD (Super MagicDrive) ROM Format Conversion Library
+//  Core of the smd2bin tool, usable from other programs
+//
+//  All functions work on caller-owned buffers: no file I/O, no allocation, no exit().
+//
+
+#include <string.h>
+#include <pthread.h>
+
+#include "libsmd.h"
+
+// x86 SIMD kernels are built with per-function target attributes,
+// so no special compiler flags are needed and the program still runs on older CPUs.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SMD_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// SMD HEADER
+// decode SMD header fields from the raw 512-byte header block
+smd_header_t smd_decode_header(const unsigned char *header_data)
+{
+        smd_header_t local_header;
+
+        local_header.interleaved_blocks_num = (int)(*(header_data + NUM_BLOCK_OFFSET));
+        local_header.is_split_rom = (int)(*(header_data + SPLIT_ROM_OFFSET));
+        local_header.binary_size = local_header.interleaved_blocks_num * SMD_ROM_BLOCK_SIZE;
+        local_header.magic_num[0] = (unsigned char)(*(header_data + SMD_MAGIC_OFFSET));
+        local_header.magic_num[1] = (unsigned char)(*(header_data + SMD_MAGIC_OFFSET + 1));
+
+        return local_header;
+}
+
+// build a 512-byte SMD header for an image of 'blocks' 16KB blocks
+void smd_encode_header(unsigned char *header_data, unsigned long blocks, int is_split_rom)
+{
+        memset(header_data, 0x00, SMD_HEADER_SIZE);
+        *(header_data + NUM_BLOCK_OFFSET) = (unsigned char)(blocks & 0xFF);
+        *(header_data + FILE_TYPE_OFFSET) = SMD_FILE_TYPE_PROGRAM;
+        *(header_data + SPLIT_ROM_OFFSET) = (unsigned char)((is_split_rom != 0) ? 1 : 0);
+        *(header_data + SMD_MAGIC_OFFSET) = SMD_MAGIC_BYTE_0;
+        *(header_data + SMD_MAGIC_OFFSET + 1) = SMD_MAGIC_BYTE_1;
+}
+
+// check SMD Header magic numbers (no output, safe to call from worker threads)
+int smd_check_header(smd_header_t header)
+{
+        if ((header.magic_num[0] != 0xAA) || (header.magic_num[1] != 0xBB)) // header corrupted or not SMD format
+            return -1;
+
+        return 0;
+}
+
+// resolve the number of 16KB blocks to decode, given the bytes available after the header.
+// the one-byte header count overflows on ROMs bigger than 4MB: in that case (or when the
+// file is truncated) the count is derived from the data size.
+unsigned long smd_block_count(smd_header_t header, unsigned long data_size)
+{
+        unsigned long size_blocks = data_size / SMD_ROM_BLOCK_SIZE;
+        unsigned long header_blocks = (unsigned long)header.interleaved_blocks_num;
+
+        if ((size_blocks > header_blocks) && ((size_blocks & 0xFF) == header_blocks))
+            return size_blocks;
+        if (size_blocks < header_blocks)
+            return size_blocks;
+
+        return header_blocks;
+}
+
+// DEINTERLEAVE KERNELS
+// reference implementation: the original byte-by-byte decoding loop.
+// kept around to validate the optimized kernels in the self test.
+void smd_deinterleave_block_reference(unsigned char *dst, const unsigned char *src)
+{
+    int inner_loop_counter;
+    int even_byte_counter = 0;
+    int odd_byte_counter = 1;
+
+    for (inner_loop_counter=0; inner_loop_counter < SMD_ROM_BLOCK_SIZE; inner_loop_counter++)
+    {
+        if (inner_loop_counter < SMD_BANK_MID_POINT)
+        {
+            *(dst + odd_byte_counter) = (unsigned char)(*(src + inner_loop_counter));
+            odd_byte_counter += SMD_INTERLEAVE_STEP;
+        }
+        else
+        {
+            *(dst + even_byte_counter) = (unsigned char)(*(src + inner_loop_counter));
+            even_byte_counter += SMD_INTERLEAVE_STEP;
+        }
+    }
+}
+
+// reference encoder: byte-by-byte inverse of the reference decoding loop
+void smd_interleave_block_reference(unsigned char *dst, const unsigned char *src)
+{
+    int inner_loop_counter;
+    int even_byte_counter = 0;
+    int odd_byte_counter = 1;
+
+    for (inner_loop_counter=0; inner_loop_counter < SMD_ROM_BLOCK_SIZE; inner_loop_counter++)
+    {
+        if (inner_loop_counter < SMD_BANK_MID_POINT)
+        {
+            *(dst + inner_loop_counter) = (unsigned char)(*(src + odd_byte_counter));
+            odd_byte_counter += SMD_INTERLEAVE_STEP;
+        }
+        else
+        {
+            *(dst + inner_loop_counter) = (unsigned char)(*(src + even_byte_counter));
+            even_byte_counter += SMD_INTERLEAVE_STEP;
+        }
+    }
+}
+
+// Kernels are written once as inline templates working on two halves of n bytes:
+// zip: dst[2i] = even_half[i], dst[2i + 1] = odd_half[i] (unzip is the inverse).
+// each template is instantiated for the fixed 16KB SMD block (constant trip count) and
+// for arbitrary lengths, used by the layout engine.
+
+// portable kernels, no per-byte branching
+static inline void zip_halves_scalar_inline(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        dst[SMD_INTERLEAVE_STEP * i] = even_half[i];
+        dst[SMD_INTERLEAVE_STEP * i + 1] = odd_half[i];
+    }
+}
+
+static inline void unzip_halves_scalar_inline(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        even_half[i] = src[SMD_INTERLEAVE_STEP * i];
+        odd_half[i] = src[SMD_INTERLEAVE_STEP * i + 1];
+    }
+}
+
+static void zip_halves_scalar(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n)
+{
+    zip_halves_scalar_inline(dst, even_half, odd_half, n);
+}
+
+static void unzip_halves_scalar(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n)
+{
+    unzip_halves_scalar_inline(even_half, odd_half, src, n);
+}
+
+static void deinterleave_block_scalar(unsigned char *dst, const unsigned char *src)
+{
+    zip_halves_scalar_inline(dst, src + SMD_BANK_MID_POINT, src, SMD_BANK_MID_POINT);
+}
+
+static void interleave_block_scalar(unsigned char *dst, const unsigned char *src)
+{
+    unzip_halves_scalar_inline(dst + SMD_BANK_MID_POINT, dst, src, SMD_BANK_MID_POINT);
+}
+
+static int kernel_always_supported(void)
+{
+    return 1;
+}
+
+#ifdef SMD_X86_KERNELS
+// SSE2 kernels: 16 bytes from each half per iteration, scalar tail
+__attribute__((target("sse2"), always_inline))
+static inline void zip_halves_sse2_inline(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i odd = _mm_loadu_si128((const __m128i *)(odd_half + i));
+        __m128i even = _mm_loadu_si128((const __m128i *)(even_half + i));
+        _mm_storeu_si128((__m128i *)(dst + 2*i), _mm_unpacklo_epi8(even, odd));
+        _mm_storeu_si128((__m128i *)(dst + 2*i + 16), _mm_unpackhi_epi8(even, odd));
+    }
+    zip_halves_scalar_inline(dst + 2*i, even_half + i, odd_half + i, n - i);
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline void unzip_halves_sse2_inline(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n)
+{
+    const __m128i even_mask = _mm_set1_epi16(0x00FF);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2*i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2*i + 16));
+        _mm_storeu_si128((__m128i *)(even_half + i), _mm_packus_epi16(_mm_and_si128(a, even_mask), _mm_and_si128(b, even_mask)));
+        _mm_storeu_si128((__m128i *)(odd_half + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    unzip_halves_scalar_inline(even_half + i, odd_half + i, src + 2*i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void zip_halves_sse2(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n)
+{
+    zip_halves_sse2_inline(dst, even_half, odd_half, n);
+}
+
+__attribute__((target("sse2")))
+static void unzip_halves_sse2(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n)
+{
+    unzip_halves_sse2_inline(even_half, odd_half, src, n);
+}
+
+__attribute__((target("sse2")))
+static void deinterleave_block_sse2(unsigned char *dst, const unsigned char *src)
+{
+    zip_halves_sse2_inline(dst, src + SMD_BANK_MID_POINT, src, SMD_BANK_MID_POINT);
+}
+
+__attribute__((target("sse2")))
+static void interleave_block_sse2(unsigned char *dst, const unsigned char *src)
+{
+    unzip_halves_sse2_inline(dst + SMD_BANK_MID_POINT, dst, src, SMD_BANK_MID_POINT);
+}
+
+static int kernel_sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+// AVX2 kernels: 32 bytes from each half per iteration, scalar tail.
+// unpack and pack work inside 128-bit lanes, so lanes are reordered before storing
+__attribute__((target("avx2"), always_inline))
+static inline void zip_halves_avx2_inline(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i odd = _mm256_loadu_si256((const __m256i *)(odd_half + i));
+        __m256i even = _mm256_loadu_si256((const __m256i *)(even_half + i));
+        __m256i lo = _mm256_unpacklo_epi8(even, odd);
+        __m256i hi = _mm256_unpackhi_epi8(even, odd);
+        _mm256_storeu_si256((__m256i *)(dst + 2*i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2*i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    zip_halves_scalar_inline(dst + 2*i, even_half + i, odd_half + i, n - i);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void unzip_halves_avx2_inline(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n)
+{
+    const __m256i even_mask = _mm256_set1_epi16(0x00FF);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + 2*i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 2*i + 32));
+        __m256i even = _mm256_packus_epi16(_mm256_and_si256(a, even_mask), _mm256_and_si256(b, even_mask));
+        __m256i odd = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256((__m256i *)(even_half + i), _mm256_permute4x64_epi64(even, 0xD8));
+        _mm256_storeu_si256((__m256i *)(odd_half + i), _mm256_permute4x64_epi64(odd, 0xD8));
+    }
+    unzip_halves_scalar_inline(even_half + i, odd_half + i, src + 2*i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void zip_halves_avx2(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n)
+{
+    zip_halves_avx2_inline(dst, even_half, odd_half, n);
+}
+
+__attribute__((target("avx2")))
+static void unzip_halves_avx2(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n)
+{
+    unzip_halves_avx2_inline(even_half, odd_half, src, n);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_block_avx2(unsigned char *dst, const unsigned char *src)
+{
+    zip_halves_avx2_inline(dst, src + SMD_BANK_MID_POINT, src, SMD_BANK_MID_POINT);
+}
+
+__attribute__((target("avx2")))
+static void interleave_block_avx2(unsigned char *dst, const unsigned char *src)
+{
+    unzip_halves_avx2_inline(dst + SMD_BANK_MID_POINT, dst, src, SMD_BANK_MID_POINT);
+}
+
+static int kernel_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// available kernels, fastest first
+static deinterleave_kernel_t deinterleave_kernels[] = {
+#ifdef SMD_X86_KERNELS
+    { "avx2", deinterleave_block_avx2, interleave_block_avx2, zip_halves_avx2, unzip_halves_avx2, kernel_avx2_supported },
+    { "sse2", deinterleave_block_sse2, interleave_block_sse2, zip_halves_sse2, unzip_halves_sse2, kernel_sse2_supported },
+#endif
+    { "scalar", deinterleave_block_scalar, interleave_block_scalar, zip_halves_scalar, unzip_halves_scalar, kernel_always_supported },
+    { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+// pick the fastest kernel supported by this CPU (selected once, safe to call from any thread)
+static deinterleave_kernel_t *selected_kernel = NULL;
+static pthread_once_t selected_kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_deinterleave_kernel(void)
+{
+    int k;
+
+    for (k = 0; deinterleave_kernels[k].name != NULL; k++)
+    {
+        if (deinterleave_kernels[k].supported())
+        {
+            selected_kernel = &deinterleave_kernels[k];
+            break;
+        }
+    }
+}
+
+deinterleave_kernel_t *smd_select_kernel(void)
+{
+    pthread_once(&selected_kernel_once, pick_deinterleave_kernel);
+    return selected_kernel;
+}
+
+// available kernels in order of preference (supported or not), NULL past the last one
+const deinterleave_kernel_t *smd_kernel(int index)
+{
+    int k;
+
+    for (k = 0; (k < index) && (deinterleave_kernels[k].name != NULL); k++)
+        ;
+    return ((index < 0) || (deinterleave_kernels[k].name == NULL)) ? NULL : &deinterleave_kernels[k];
+}
+
+// CONTENT DIGESTS
+// CRC32 lookup table, built once
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc32_table(void)
+{
+    uint32_t c;
+    int n, k;
+
+    for (n = 0; n < 256; n++)
+    {
+        c = (uint32_t)n;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? (CRC32_POLYNOMIAL ^ (c >> 1)) : (c >> 1);
+        crc32_table[n] = c;
+    }
+}
+
+#define SHA1_ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+// SHA-1 compression function over one 64-byte block
+static void sha1_transform(uint32_t state[5], const unsigned char *block)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, temp;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[4*i] << 24) | ((uint32_t)block[4*i + 1] << 16) | ((uint32_t)block[4*i + 2] << 8) | (uint32_t)block[4*i + 3];
+    for (i = 16; i < 80; i++)
+        w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+        temp = SHA1_ROL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = temp;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+static void sha1_init(sha1_context_t *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->length = 0;
+}
+
+static void sha1_update(sha1_context_t *ctx, const unsigned char *data, size_t len)
+{
+    size_t pending = (size_t)(ctx->length % SHA1_BLOCK_LEN);
+    size_t fill;
+
+    ctx->length += len;
+    // complete a pending partial block first
+    if (pending > 0)
+    {
+        fill = SHA1_BLOCK_LEN - pending;
+        if (len < fill)
+        {
+            memcpy(ctx->buffer + pending, data, len);
+            return;
+        }
+        memcpy(ctx->buffer + pending, data, fill);
+        sha1_transform(ctx->state, ctx->buffer);
+        data += fill;
+        len -= fill;
+    }
+    // whole blocks straight from the input
+    while (len >= SHA1_BLOCK_LEN)
+    {
+        sha1_transform(ctx->state, data);
+        data += SHA1_BLOCK_LEN;
+        len -= SHA1_BLOCK_LEN;
+    }
+    memcpy(ctx->buffer, data, len);
+}
+
+static void sha1_final(sha1_context_t *ctx, unsigned char digest[SHA1_DIGEST_LEN])
+{
+    unsigned char padding[SHA1_BLOCK_LEN * 2];
+    uint64_t bit_length = ctx->length * 8;
+    size_t pending = (size_t)(ctx->length % SHA1_BLOCK_LEN);
+    size_t pad_len = (pending < 56) ? (56 - pending) : (120 - pending);
+    int i;
+
+    memset(padding, 0x00, sizeof(padding));
+    padding[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        padding[pad_len + i] = (unsigned char)(bit_length >> (56 - 8*i));
+    sha1_update(ctx, padding, pad_len + 8);
+
+    for (i = 0; i < SHA1_DIGEST_LEN; i++)
+        digest[i] = (unsigned char)(ctx->state[i / 4] >> (24 - 8*(i % 4)));
+}
+
+void smd_digest_init(rom_digest_t *digest)
+{
+    pthread_once(&crc32_table_once, build_crc32_table);
+    digest->position = 0;
+    digest->checksum = 0;
+    digest->crc32 = 0xFFFFFFFF;
+    sha1_init(&digest->sha1_context);
+}
+
+// digest the next chunk of the decoded image (chunks must have an even size)
+void smd_digest_update(rom_digest_t *digest, const unsigned char *data, size_t len)
+{
+    uint32_t crc = digest->crc32;
+    uint16_t checksum = digest->checksum;
+    size_t i = 0;
+
+    // header checksum: big endian words after the header
+    if (digest->position < BIN_CHECKSUM_START)
+        i = BIN_CHECKSUM_START - digest->position;
+    for (; i + 1 < len; i += 2)
+        checksum += (uint16_t)((data[i] << 8) | data[i + 1]);
+
+    for (i = 0; i < len; i++)
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    sha1_update(&digest->sha1_context, data, len);
+    digest->checksum = checksum;
+    digest->crc32 = crc;
+    digest->position += len;
+}
+
+void smd_digest_final(rom_digest_t *digest)
+{
+    digest->crc32 ^= 0xFFFFFFFF;
+    sha1_final(&digest->sha1_context, digest->sha1);
+}
+
+// checksum stored in the ROM header
+uint16_t smd_stored_checksum(const unsigned char *binary_data)
+{
+    return (uint16_t)((binary_data[BIN_CHECKSUM_OFFSET] << 8) | binary_data[BIN_CHECKSUM_OFFSET + 1]);
+}
+
+// BLOCK CONVERSION
+// decode consecutive 16KB blocks, digesting each one right after it has been decoded
+void smd_decode_blocks(unsigned char *bin_data, const unsigned char *smd_blocks, unsigned long blocks, rom_digest_t *digest)
+{
+    deinterleave_kernel_t *kernel = smd_select_kernel();
+    unsigned long counter;
+
+    for (counter = 0; counter < blocks; counter++)
+    {
+        kernel->decode(bin_data + (counter * SMD_ROM_BLOCK_SIZE), smd_blocks + (counter * SMD_ROM_BLOCK_SIZE));
+        if (digest != NULL)
+            smd_digest_update(digest, bin_data + (counter * SMD_ROM_BLOCK_SIZE), SMD_ROM_BLOCK_SIZE);
+    }
+}
+
+void smd_encode_blocks(unsigned char *smd_blocks, const unsigned char *bin_data, unsigned long blocks)
+{
+    deinterleave_kernel_t *kernel = smd_select_kernel();
+    unsigned long counter;
+
+    for (counter = 0; counter < blocks; counter++)
+        kernel->encode(smd_blocks + (counter * SMD_ROM_BLOCK_SIZE), bin_data + (counter * SMD_ROM_BLOCK_SIZE));
+}
+
+// IMAGE CONVERSION
+// validate an SMD image and resolve its block count
+static int smd_image_blocks(const unsigned char *smd_data, size_t smd_size, smd_header_t *header, unsigned long *blocks)
+{
+    if ((smd_data == NULL) || (smd_size < SMD_HEADER_SIZE))
+        return SMD_ERR_INVALID_ARGUMENT;
+
+    *header = smd_decode_header(smd_data);
+    if (smd_check_header(*header) < 0)
+        return SMD_ERR_BAD_MAGIC;
+
+    *blocks = smd_block_count(*header, (unsigned long)(smd_size - SMD_HEADER_SIZE));
+    if (*blocks < (unsigned long)header->interleaved_blocks_num)
+        return SMD_ERR_TRUNCATED;
+    if (*blocks == 0)
+        return SMD_ERR_NO_DATA;
+
+    return SMD_OK;
+}
+
+size_t smd_decoded_size(const unsigned char *smd_data, size_t smd_size)
+{
+    smd_header_t header;
+    unsigned long blocks;
+
+    if (smd_image_blocks(smd_data, smd_size, &header, &blocks) != SMD_OK)
+        return 0;
+    return (size_t)blocks * SMD_ROM_BLOCK_SIZE;
+}
+
+size_t smd_encoded_size(size_t bin_size)
+{
+    return SMD_HEADER_SIZE + (((bin_size + SMD_ROM_BLOCK_SIZE - 1) / SMD_ROM_BLOCK_SIZE) * SMD_ROM_BLOCK_SIZE);
+}
+
+// copy a fixed-size header field into a NUL-terminated string
+static void copy_bin_header_field(char *dst, const unsigned char *src, size_t len)
+{
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+void smd_read_bin_header(const unsigned char *bin_data, smd_result_t *result)
+{
+    copy_bin_header_field(result->system_name, bin_data + BIN_SYSTEM_NAME_OFFSET, SYSTEM_STR_LEN);
+    copy_bin_header_field(result->software_name, bin_data + BIN_SOFTWARE_TITLE_DOMESTIC, SWNAME_STR_LEN);
+    copy_bin_header_field(result->software_name_overseas, bin_data + BIN_SOFTWARE_TITLE_OVERSEAS, SWNAME_STR_LEN_OVERSEAS);
+    copy_bin_header_field(result->copyright_notice, bin_data + BIN_SW_COPYRIGHT_NOTICE, COPYRIGHT_NOTICE_LEN);
+    copy_bin_header_field(result->regional_lockout, bin_data + BIN_SOFTWARE_LOCK_CODE, LOCKDOWN_CODE_LEN);
+    result->stored_checksum = smd_stored_checksum(bin_data);
+}
+
+// decode a whole SMD image (header included) into bin_data
+int smd_decode_buffer(const unsigned char *smd_data, size_t smd_size, unsigned char *bin_data, size_t bin_capacity, int flags, smd_result_t *result)
+{
+    return smd_decode_layout(smd_find_layout("smd"), smd_data, smd_size, bin_data, bin_capacity, flags, result);
+}
+
+// encode a BIN image into a whole SMD image (header included), padding the last block
+int smd_encode_buffer(const unsigned char *bin_data, size_t bin_size, unsigned char *smd_data, size_t smd_capacity, int flags, smd_result_t *result)
+{
+    unsigned char last_block[SMD_ROM_BLOCK_SIZE];
+    unsigned long blocks, full_blocks;
+    size_t tail;
+
+    if ((bin_data == NULL) || (smd_data == NULL) || (result == NULL))
+        return SMD_ERR_INVALID_ARGUMENT;
+    if (bin_size == 0)
+        return SMD_ERR_NO_DATA;
+    if (smd_capacity < smd_encoded_size(bin_size))
+        return SMD_ERR_BUFFER_TOO_SMALL;
+
+    full_blocks = (unsigned long)(bin_size / SMD_ROM_BLOCK_SIZE);
+    tail = bin_size % SMD_ROM_BLOCK_SIZE;
+    blocks = full_blocks + ((tail != 0) ? 1 : 0);
+
+    memset(result, 0x00, sizeof(smd_result_t));
+    smd_encode_header(smd_data, blocks, 0);
+    result->header = smd_decode_header(smd_data);
+    result->blocks = blocks;
+    result->bin_size = bin_size;
+    result->smd_size = smd_encoded_size(bin_size);
+    result->kernel = smd_select_kernel()->name;
+
+    if (flags & SMD_FLAG_DIGEST)
+    {
+        smd_digest_init(&result->digest);
+        smd_digest_update(&result->digest, bin_data, bin_size);
+        smd_digest_final(&result->digest);
+    }
+
+    smd_encode_blocks(smd_data + SMD_HEADER_SIZE, bin_data, full_blocks);
+    if (tail != 0)
+    {
+        memcpy(last_block, bin_data + ((size_t)full_blocks * SMD_ROM_BLOCK_SIZE), tail);
+        memset(last_block + tail, SMD_PADDING_BYTE, SMD_ROM_BLOCK_SIZE - tail);
+        smd_encode_blocks(smd_data + SMD_HEADER_SIZE + ((size_t)full_blocks * SMD_ROM_BLOCK_SIZE), last_block, 1);
+    }
+
+    if (bin_size >= BIN_CHECKSUM_START)
+        smd_read_bin_header(bin_data, result);
+    return SMD_OK;
+}
+
+const char *smd_strerror(int status)
+{
+    switch (status)
+    {
+        case SMD_OK:
+            return "OK";
+        case SMD_ERR_INVALID_ARGUMENT:
+            return "invalid argument";
+        case SMD_ERR_BAD_MAGIC:
+            return "not in SMD format or SMD header corrupted";
+        case SMD_ERR_TRUNCATED:
+            return "SMD image is truncated (shorter than the header block count)";
+        case SMD_ERR_NO_DATA:
+            return "no data blocks";
+        case SMD_ERR_BUFFER_TOO_SMALL:
+            return "output buffer too small";
+        case SMD_ERR_BAD_LAYOUT:
+            return "invalid layout descriptor";
+        default:
+            return "unknown error";
+    }
+}
+
+// LAYOUT ENGINE
+// SMD and 32X images: fixed 16KB blocks, use the block kernels with a constant trip count
+static void decode_layout_smd(unsigned char *bin_data, const unsigned char *src, size_t size, rom_digest_t *digest)
+{
+    smd_decode_blocks(bin_data, src, (unsigned long)(size / SMD_ROM_BLOCK_SIZE), digest);
+}
+
+// known copier layouts, new formats only need a new entry
+const smd_layout_t smd_layouts[] = {
+    { "smd", SMD_FORMAT_SMD, SMD_HEADER_SIZE, 1, SMD_ROM_BLOCK_SIZE, SMD_INTERLEAVE_STEP, decode_layout_smd },
+    { "32x", SMD_FORMAT_32X, SMD_HEADER_SIZE, 1, SMD_ROM_BLOCK_SIZE, SMD_INTERLEAVE_STEP, decode_layout_smd },
+    { "mgd", SMD_FORMAT_MGD, 0, 0, 0, SMD_INTERLEAVE_STEP, NULL },
+    { NULL, SMD_FORMAT_UNKNOWN, 0, 0, 0, 0, NULL }
+};
+
+const smd_layout_t *smd_find_layout(const char *name)
+{
+    const smd_layout_t *layout;
+
+    if (name == NULL)
+        return NULL;
+    for (layout = smd_layouts; layout->name != NULL; layout++)
+    {
+        if (strcmp(layout->name, name) == 0)
+            return layout;
+    }
+    return NULL;
+}
+
+const smd_layout_t *smd_layout_for_format(int format)
+{
+    const smd_layout_t *layout;
+
+    for (layout = smd_layouts; layout->name != NULL; layout++)
+    {
+        if (layout->format == format)
+            return layout;
+    }
+    return NULL;
+}
+
+static int check_layout(const smd_layout_t *layout)
+{
+    if (layout->interleave_step < SMD_INTERLEAVE_STEP)
+        return SMD_ERR_BAD_LAYOUT;
+    if ((layout->block_size % layout->interleave_step) != 0)
+        return SMD_ERR_BAD_LAYOUT;
+    if (layout->smd_header && ((layout->header_size != SMD_HEADER_SIZE) || (layout->block_size != SMD_ROM_BLOCK_SIZE)))
+        return SMD_ERR_BAD_LAYOUT;
+    return SMD_OK;
+}
+
+// decodable data size: whole blocks only (or the whole image split in equal lanes)
+static size_t layout_data_size(const smd_layout_t *layout, size_t size)
+{
+    size_t data_size;
+
+    if (size < layout->header_size)
+        return 0;
+    data_size = size - layout->header_size;
+    if (layout->block_size != 0)
+        return data_size - (data_size % layout->block_size);
+    return data_size - (data_size % layout->interleave_step);
+}
+
+// generic engine: any block geometry.
+// two-lane blocks go through the SIMD zip kernel in chunks, so that each chunk is
+// digested while still hot in cache; other lane counts use a portable loop.
+static void decode_layout_generic(const smd_layout_t *layout, unsigned char *bin_data, const unsigned char *src, size_t size, rom_digest_t *digest)
+{
+    deinterleave_kernel_t *kernel = smd_select_kernel();
+    size_t step = layout->interleave_step;
+    size_t block_size = (layout->block_size != 0) ? layout->block_size : size;
+    size_t lane_size = block_size / step;
+    size_t offset, done, chunk, lane, i;
+
+    for (offset = 0; offset < size; offset += block_size)
+    {
+        if (step == SMD_INTERLEAVE_STEP)
+        {
+            for (done = 0; done < lane_size; done += chunk)
+            {
+                chunk = lane_size - done;
+                if (chunk > SMD_BANK_MID_POINT)
+                    chunk = SMD_BANK_MID_POINT;
+                kernel->zip(bin_data + offset + SMD_INTERLEAVE_STEP * done, src + offset + lane_size + done, src + offset + done, chunk);
+                if (digest != NULL)
+                    smd_digest_update(digest, bin_data + offset + SMD_INTERLEAVE_STEP * done, SMD_INTERLEAVE_STEP * chunk);
+            }
+        }
+        else
+        {
+            for (lane = 0; lane < step; lane++)
+            {
+                for (i = 0; i < lane_size; i++)
+                    bin_data[offset + (i * step) + (step - 1 - lane)] = src[offset + (lane * lane_size) + i];
+            }
+            if (digest != NULL)
+                smd_digest_update(digest, bin_data + offset, block_size);
+        }
+    }
+}
+
+size_t smd_layout_decoded_size(const smd_layout_t *layout, const unsigned char *data, size_t size)
+{
+    if ((layout == NULL) || (check_layout(layout) != SMD_OK))
+        return 0;
+    if (layout->smd_header)
+        return smd_decoded_size(data, size);
+    return layout_data_size(layout, size);
+}
+
+// decode a whole image (header included) laid out as described by 'layout' into bin_data
+int smd_decode_layout(const smd_layout_t *layout, const unsigned char *data, size_t size, unsigned char *bin_data, size_t bin_capacity, int flags, smd_result_t *result)
+{
+    smd_header_t header;
+    unsigned long blocks;
+    size_t bin_size;
+    rom_digest_t *digest = NULL;
+    int status;
+
+    if ((layout == NULL) || (data == NULL) || (bin_data == NULL) || (result == NULL))
+        return SMD_ERR_INVALID_ARGUMENT;
+    status = check_layout(layout);
+    if (status != SMD_OK)
+        return status;
+
+    memset(&header, 0x00, sizeof(smd_header_t));
+    if (layout->smd_header)
+    {
+        status = smd_image_blocks(data, size, &header, &blocks);
+        if (status != SMD_OK)
+            return status;
+        bin_size = (size_t)blocks * SMD_ROM_BLOCK_SIZE;
+    }
+    else
+    {
+        bin_size = layout_data_size(layout, size);
+        if (bin_size == 0)
+            return SMD_ERR_NO_DATA;
+        blocks = (layout->block_size != 0) ? (unsigned long)(bin_size / layout->block_size) : 1;
+    }
+    if (bin_capacity < bin_size)
+        return SMD_ERR_BUFFER_TOO_SMALL;
+
+    memset(result, 0x00, sizeof(smd_result_t));
+    result->header = header;
+    result->blocks = blocks;
+    result->bin_size = bin_size;
+    result->smd_size = layout->header_size + bin_size;
+    result->kernel = smd_select_kernel()->name;
+
+    if (flags & SMD_FLAG_DIGEST)
+    {
+        digest = &result->digest;
+        smd_digest_init(digest);
+    }
+    if (layout->decode != NULL)
+        layout->decode(bin_data, data + layout->header_size, bin_size, digest);
+    else
+        decode_layout_generic(layout, bin_data, data + layout->header_size, bin_size, digest);
+    if (digest != NULL)
+        smd_digest_final(digest);
+
+    if (bin_size >= BIN_CHECKSUM_START)
+        smd_read_bin_header(bin_data, result);
+    return SMD_OK;
+}
+
+// FORMAT DETECTION
+// does a 16-byte system name field contain 'tag'?
+static int has_tag(const unsigned char *system_name, const char *tag, int tag_len)
+{
+    int i;
+
+    for (i = 0; i <= SYSTEM_STR_LEN - tag_len; i++)
+    {
+        if (memcmp(system_name + i, tag, tag_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int has_system_tag(const unsigned char *system_name)
+{
+    return has_tag(system_name, SYSTEM_TAG, SYSTEM_TAG_LEN);
+}
+
+// rebuild the BIN system name field from two interleaved halves
+// (even bytes come from even_half, odd bytes from odd_half, starting at index 'first')
+static void trial_deinterleave(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t first, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len / 2; i++)
+    {
+        dst[2*i] = even_half[first + i];
+        dst[2*i + 1] = odd_half[first + i];
+    }
+}
+
+// count frequent 68000 opcodes among 'words' words whose high bytes are at hi[i * step] and low bytes at lo[i * step]
+static int count_68k_opcodes(const unsigned char *hi, const unsigned char *lo, size_t step, size_t words)
+{
+    size_t i;
+    int hits = 0;
+
+    for (i = 0; i < words; i++)
+    {
+        if (hi[i * step] != 0x4E)
+            continue;
+        switch (lo[i * step])
+        {
+            case 0x75:  // RTS
+            case 0x71:  // NOP
+            case 0xB9:  // JSR abs.l
+            case 0xF9:  // JMP abs.l
+                hits++;
+                break;
+        }
+    }
+    return hits;
+}
+
+int smd_detect_format(const unsigned char *data, size_t size, smd_detection_t *detection)
+{
+    unsigned char system_name[SYSTEM_STR_LEN];
+    const unsigned char *block;
+    smd_header_t header;
+    unsigned long size_blocks;
+    size_t half, offset;
+    int sample, hits[SMD_FORMAT_COUNT] = { 0 };
+    int best, second, format, is_32x = 0;
+
+    if ((data == NULL) || (detection == NULL))
+        return SMD_ERR_INVALID_ARGUMENT;
+    memset(detection, 0x00, sizeof(smd_detection_t));
+    if (size < BIN_CHECKSUM_START)
+        return SMD_OK;
+
+    // SMD: header magic, file size, block count, system tag after deinterleaving block 0
+    header = smd_decode_header(data);
+    if (smd_check_header(header) == 0)
+        detection->scores[SMD_FORMAT_SMD] += 40;
+    if ((size % SMD_ROM_BLOCK_SIZE) == SMD_HEADER_SIZE)
+    {
+        detection->scores[SMD_FORMAT_SMD] += 25;
+        size_blocks = (unsigned long)((size - SMD_HEADER_SIZE) / SMD_ROM_BLOCK_SIZE);
+        if ((header.interleaved_blocks_num != 0) && ((size_blocks & 0xFF) == (unsigned long)header.interleaved_blocks_num))
+            detection->scores[SMD_FORMAT_SMD] += 15;
+    }
+    if (size >= SMD_HEADER_SIZE + SMD_ROM_BLOCK_SIZE)
+    {
+        trial_deinterleave(system_name, data + SMD_HEADER_SIZE + SMD_BANK_MID_POINT, data + SMD_HEADER_SIZE, BIN_SYSTEM_NAME_OFFSET / 2, SYSTEM_STR_LEN);
+        if (has_system_tag(system_name))
+            detection->scores[SMD_FORMAT_SMD] += 40;
+        is_32x = has_tag(system_name, SYSTEM_TAG_32X, SYSTEM_TAG_32X_LEN);
+    }
+
+    // BIN: system tag in place
+    if (has_system_tag(data + BIN_SYSTEM_NAME_OFFSET))
+        detection->scores[SMD_FORMAT_BIN] += 60;
+    if ((size % SMD_ROM_BLOCK_SIZE) == 0)
+    {
+        detection->scores[SMD_FORMAT_BIN] += 10;
+        detection->scores[SMD_FORMAT_MGD] += 10;
+    }
+
+    // MGD: system tag after deinterleaving the two halves of the whole image
+    half = size / 2;
+    if ((size % 2) == 0)
+    {
+        trial_deinterleave(system_name, data + half, data, BIN_SYSTEM_NAME_OFFSET / 2, SYSTEM_STR_LEN);
+        if (has_system_tag(system_name))
+            detection->scores[SMD_FORMAT_MGD] += 60;
+    }
+
+    // opcode statistics over a few sampled blocks, under each layout
+    for (sample = 0; sample < DETECT_SAMPLE_BLOCKS; sample++)
+    {
+        offset = SMD_HEADER_SIZE + ((size - SMD_HEADER_SIZE) / (DETECT_SAMPLE_BLOCKS + 1)) * (sample + 1);
+        offset -= (offset - SMD_HEADER_SIZE) % SMD_ROM_BLOCK_SIZE;
+        if (offset + SMD_ROM_BLOCK_SIZE <= size)
+        {
+            block = data + offset;
+            hits[SMD_FORMAT_SMD] += count_68k_opcodes(block + SMD_BANK_MID_POINT, block, 1, DETECT_SAMPLE_SIZE);
+        }
+        offset -= SMD_HEADER_SIZE;
+        if (offset + 2 * DETECT_SAMPLE_SIZE <= size)
+            hits[SMD_FORMAT_BIN] += count_68k_opcodes(data + offset, data + offset + 1, 2, DETECT_SAMPLE_SIZE);
+        if (((size % 2) == 0) && (offset / 2 + DETECT_SAMPLE_SIZE <= half))
+            hits[SMD_FORMAT_MGD] += count_68k_opcodes(data + half + offset / 2, data + offset / 2, 1, DETECT_SAMPLE_SIZE);
+    }
+    for (format = SMD_FORMAT_SMD; format <= SMD_FORMAT_MGD; format++)
+    {
+        if ((hits[format] > 0) && (hits[format] >= 2 * (hits[SMD_FORMAT_SMD] + hits[SMD_FORMAT_BIN] + hits[SMD_FORMAT_MGD] - hits[format])))
+            detection->scores[format] += 20;
+    }
+
+    // pick the best candidate, confidence drops when the runner up is close
+    best = SMD_FORMAT_UNKNOWN;
+    second = 0;
+    for (format = SMD_FORMAT_SMD; format <= SMD_FORMAT_MGD; format++)
+    {
+        if (detection->scores[format] > detection->scores[best])
+        {
+            if (best != SMD_FORMAT_UNKNOWN)
+                second = detection->scores[best];
+            best = format;
+        }
+        else if (detection->scores[format] > second)
+        {
+            second = detection->scores[format];
+        }
+    }
+    // a 32X program shares the SMD container, told apart by its system name
+    if ((best == SMD_FORMAT_SMD) && is_32x)
+    {
+        best = SMD_FORMAT_32X;
+        detection->scores[SMD_FORMAT_32X] = detection->scores[SMD_FORMAT_SMD];
+    }
+    detection->format = best;
+    if (best != SMD_FORMAT_UNKNOWN)
+    {
+        detection->confidence = detection->scores[best] - (second / 2);
+        if (detection->confidence > 100)
+            detection->confidence = 100;
+        if (detection->confidence < 0)
+            detection->confidence = 0;
+    }
+
+    return SMD_OK;
+}
+
+const char *smd_format_name(int format)
+{
+    switch (format)
+    {
+        case SMD_FORMAT_SMD:
+            return "SMD";
+        case SMD_FORMAT_BIN:
+            return "BIN";
+        case SMD_FORMAT_MGD:
+            return "MGD";
+        case SMD_FORMAT_32X:
+            return "32X";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+// EOF
@@ -0,0 +1,259 @@
+//
+//  libsmd - SMD (Super MagicDrive) ROM Format Conversion Library
+//  Core of the smd2bin tool, usable from other programs
+//
+//  Converts SMD dumps to BIN (RAW) dumps and back, working only on caller-owned memory buffers:
+//  no file I/O, no memory allocation and no process exit. Every function that can fail returns
+//  an SMD_STATUS code (SMD_OK == 0, errors are negative).
+//
+//  Build as a static or shared library:
+//      gcc -O2 -c libsmd.c && ar rcs libsmd.a libsmd.o
+//      gcc -O2 -fPIC -shared -o libsmd.so libsmd.c -pthread
+//
+
+#ifndef LIBSMD_H
+#define LIBSMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SMD Header
+struct SMD_HEADER {
+    int interleaved_blocks_num;
+    int is_split_rom;
+    int binary_size;
+    unsigned char magic_num[2]; // 8-bit values
+};
+
+typedef struct SMD_HEADER smd_header_t;
+
+//  SMD is an interleaved format, the rom is composed of 16KB blocks
+//  in which odd bytes are encoded in the beginning of the block (first half)
+//  and even bytes are encoded in the end of the block (second half)
+//
+//  The header is 512 bytes long:
+//  Byte    0x00:   Number of 16KB Blocks in the ROM image
+//  Byte    0x02:   Split ROM magic number (0 == Standalone ROM or last ROM in a splitserie, 1 == Split ROM)
+//  Byte    0x08:   Value 0xAA  -- SMD Header Magic Number
+//  Byte    0x09:   Value 0xBB  -- SMD Header Magic Number
+//  SMD Format Constants
+#define SMD_HEADER_SIZE   0x200   // 512 Bytes
+#define SMD_ROM_BLOCK_SIZE  0x4000  // 16 KBytes
+#define SMD_BANK_MID_POINT  0x2000  // 8 KBytes
+// Header Offsets
+#define NUM_BLOCK_OFFSET    0x00
+#define FILE_TYPE_OFFSET    0x01
+#define SPLIT_ROM_OFFSET    0x02
+#define SMD_MAGIC_OFFSET    0x08
+#define SMD_INTERLEAVE_STEP 0x02
+// Header Values (written by the encoder)
+#define SMD_FILE_TYPE_PROGRAM   0x03    // 68000 program data
+#define SMD_MAGIC_BYTE_0        0xAA
+#define SMD_MAGIC_BYTE_1        0xBB
+#define SMD_PADDING_BYTE        0x00    // fills the last block of a BIN image that is not a multiple of 16KB
+
+// BIN (RAW) ROM Dump Header
+// The BIN Format is simply a RAW byte dump of the content of the cartridge.
+//
+// Interesting Offset in BIN Header (see hexdump -C for reference)
+// Byte     0x100:  System Name Tag
+// Byte     0x110:  Copyright Notice
+// Byte     0x120:  Software Title (DOMESTIC)
+// Byte     0x150:  Software Title (OVERSEAS)
+// Byte     0x1F0:  Software Country Lockdown Code
+#define BIN_SYSTEM_NAME_OFFSET          0x100
+#define BIN_SW_COPYRIGHT_NOTICE         0x110
+#define BIN_SOFTWARE_TITLE_DOMESTIC     0x120
+#define BIN_SOFTWARE_TITLE_OVERSEAS     0x150
+#define BIN_SOFTWARE_LOCK_CODE          0x1F0
+
+// Header Checksum
+// 16-bit big endian word at 0x18E: sum of all the 16-bit words of the ROM after the header (0x200 onwards)
+#define BIN_CHECKSUM_OFFSET             0x18E
+#define BIN_CHECKSUM_START              0x200
+
+// sizes
+#define SYSTEM_STR_LEN          0x10    // 16 bytes
+#define COPYRIGHT_NOTICE_LEN    0x10    // 16 bytes
+#define SWNAME_STR_LEN          0x30    // 48 bytes
+#define SWNAME_STR_LEN_OVERSEAS 0x30    // 48 bytes
+#define LOCKDOWN_CODE_LEN       0x03    // 3 bytes
+
+// Deinterleave Kernels
+// A kernel decodes one full 16KB SMD block (src) into 16KB of BIN data (dst):
+// dst[2n] = src[SMD_BANK_MID_POINT + n], dst[2n + 1] = src[n]
+// and encodes BIN data back into an SMD block (the inverse operation).
+// The same kernels are also available for two halves of any length (zip/unzip):
+// zip: dst[2n] = even_half[n], dst[2n + 1] = odd_half[n], unzip is the inverse.
+// Several implementations are available (portable scalar, SSE2, AVX2), the
+// fastest one supported by the running CPU is selected at runtime.
+typedef void (*deinterleave_fn_t)(unsigned char *dst, const unsigned char *src);
+typedef void (*interleave_fn_t)(unsigned char *dst, const unsigned char *src);
+typedef void (*zip_fn_t)(unsigned char *dst, const unsigned char *even_half, const unsigned char *odd_half, size_t n);
+typedef void (*unzip_fn_t)(unsigned char *even_half, unsigned char *odd_half, const unsigned char *src, size_t n);
+
+struct DEINTERLEAVE_KERNEL {
+    const char *name;
+    deinterleave_fn_t decode;
+    interleave_fn_t encode;
+    zip_fn_t zip;
+    unzip_fn_t unzip;
+    int (*supported)(void);
+};
+
+typedef struct DEINTERLEAVE_KERNEL deinterleave_kernel_t;
+
+// Content Digests
+// header checksum, CRC32 and SHA-1 are computed during decoding, on each block while still hot in cache
+#define SHA1_DIGEST_LEN     20
+#define SHA1_BLOCK_LEN      64
+#define CRC32_POLYNOMIAL    0xEDB88320
+
+struct SHA1_CONTEXT {
+    uint32_t state[5];
+    uint64_t length;                        // bytes hashed so far
+    unsigned char buffer[SHA1_BLOCK_LEN];   // pending partial block
+};
+
+typedef struct SHA1_CONTEXT sha1_context_t;
+
+struct ROM_DIGEST {
+    unsigned long position;                 // bytes of the image digested so far
+    uint16_t checksum;                      // Mega Drive header checksum
+    uint32_t crc32;
+    sha1_context_t sha1_context;
+    unsigned char sha1[SHA1_DIGEST_LEN];    // valid after smd_digest_final()
+};
+
+typedef struct ROM_DIGEST rom_digest_t;
+
+// Status Codes
+enum SMD_STATUS {
+    SMD_OK = 0,
+    SMD_ERR_INVALID_ARGUMENT = -1,  // NULL pointers or empty buffers
+    SMD_ERR_BAD_MAGIC = -2,         // not in SMD format or SMD header corrupted
+    SMD_ERR_TRUNCATED = -3,         // less data than announced by the SMD header
+    SMD_ERR_NO_DATA = -4,           // no data blocks in the image
+    SMD_ERR_BUFFER_TOO_SMALL = -5,  // output buffer cannot hold the converted image
+    SMD_ERR_BAD_LAYOUT = -6         // layout descriptor with an impossible geometry
+};
+
+// Conversion Flags
+#define SMD_FLAG_DIGEST     0x01    // compute header checksum, CRC32 and SHA-1 while converting
+
+// Conversion Result
+// filled by the conversion functions with the SMD header data and the BIN header contents
+struct SMD_RESULT {
+    smd_header_t header;                                // decoded SMD header
+    unsigned long blocks;                               // converted 16KB blocks
+    size_t bin_size;                                    // size of the BIN image
+    size_t smd_size;                                    // size of the SMD image (header included)
+    char system_name[SYSTEM_STR_LEN + 1];
+    char software_name[SWNAME_STR_LEN + 1];
+    char software_name_overseas[SWNAME_STR_LEN_OVERSEAS + 1];
+    char copyright_notice[COPYRIGHT_NOTICE_LEN + 1];
+    char regional_lockout[LOCKDOWN_CODE_LEN + 1];
+    uint16_t stored_checksum;                           // checksum found in the BIN header
+    rom_digest_t digest;                                // valid with SMD_FLAG_DIGEST
+    const char *kernel;                                 // name of the kernel used
+};
+
+typedef struct SMD_RESULT smd_result_t;
+
+// Format Detection
+// a file is classified by sampling a few places of it: the 512-byte SMD header, the file size
+// modulo 16KB, the "SEGA" tag at 0x100 after a trial deinterleave of the first bytes, and the
+// density of common 68000 opcodes (RTS, NOP, JSR, JMP) in a few sampled blocks under each layout.
+// only the sampled pages are touched, so detection is cheap on memory mapped files.
+enum SMD_FORMAT {
+    SMD_FORMAT_UNKNOWN = 0,
+    SMD_FORMAT_SMD,                 // Super MagicDrive: 512-byte header, 16KB interleaved blocks
+    SMD_FORMAT_BIN,                 // raw cartridge dump
+    SMD_FORMAT_MGD,                 // Multi Game Doctor: no header, whole image interleaved
+    SMD_FORMAT_32X,                 // 32X program in an SMD container
+    SMD_FORMAT_COUNT
+};
+
+struct SMD_DETECTION {
+    int format;                     // SMD_FORMAT
+    int confidence;                 // 0..100
+    int scores[SMD_FORMAT_COUNT];   // evidence collected for each format
+};
+
+typedef struct SMD_DETECTION smd_detection_t;
+
+#define DETECT_SAMPLE_BLOCKS    4       // blocks sampled for opcode statistics
+#define DETECT_SAMPLE_SIZE      0x800   // bytes of each sampled block checked
+#define SYSTEM_TAG              "SEGA"
+#define SYSTEM_TAG_LEN          4
+#define SYSTEM_TAG_32X          "32X"
+#define SYSTEM_TAG_32X_LEN      3
+
+// Copier Layouts
+// Each copier format is described by a table entry: the decoding engine is shared.
+// The image is a header followed by blocks; each block holds 'interleave_step' lanes of
+// the same size, lane k carrying the output bytes at phase (interleave_step - 1 - k).
+// SMD: 16KB blocks with the odd bytes in the first 8KB, MGD: the whole image is one block.
+typedef void (*layout_decode_fn_t)(unsigned char *bin_data, const unsigned char *src, size_t size, rom_digest_t *digest);
+
+struct SMD_LAYOUT {
+    const char *name;
+    int format;                     // SMD_FORMAT
+    size_t header_size;             // bytes skipped before the data
+    int smd_header;                 // the header carries the SMD magic and block count
+    size_t block_size;              // 0: the whole image is a single block
+    size_t interleave_step;         // lanes in each block
+    layout_decode_fn_t decode;      // specialized decoder, NULL: generic engine
+};
+
+typedef struct SMD_LAYOUT smd_layout_t;
+
+// SMD Header
+smd_header_t smd_decode_header(const unsigned char *header_data);
+void smd_encode_header(unsigned char *header_data, unsigned long blocks, int is_split_rom);
+int smd_check_header(smd_header_t header);
+unsigned long smd_block_count(smd_header_t header, unsigned long data_size);
+
+// Kernels
+// smd_kernel() walks the available kernels (for validation), smd_select_kernel() is the one in use
+const deinterleave_kernel_t *smd_kernel(int index);
+deinterleave_kernel_t *smd_select_kernel(void);
+void smd_deinterleave_block_reference(unsigned char *dst, const unsigned char *src);
+void smd_interleave_block_reference(unsigned char *dst, const unsigned char *src);
+
+// Content Digests
+void smd_digest_init(rom_digest_t *digest);
+void smd_digest_update(rom_digest_t *digest, const unsigned char *data, size_t len);
+void smd_digest_final(rom_digest_t *digest);
+uint16_t smd_stored_checksum(const unsigned char *binary_data);
+
+// Block Conversion
+// convert 'blocks' consecutive 16KB blocks (the SMD header is not included in smd_blocks)
+void smd_decode_blocks(unsigned char *bin_data, const unsigned char *smd_blocks, unsigned long blocks, rom_digest_t *digest);
+void smd_encode_blocks(unsigned char *smd_blocks, const unsigned char *bin_data, unsigned long blocks);
+
+// Image Conversion
+// size of the BIN image decoded from an SMD image (0 if the SMD image is invalid)
+size_t smd_decoded_size(const unsigned char *smd_data, size_t smd_size);
+// size of the SMD image encoded from a BIN image (the last block is padded)
+size_t smd_encoded_size(size_t bin_size);
+int smd_decode_buffer(const unsigned char *smd_data, size_t smd_size, unsigned char *bin_data, size_t bin_capacity, int flags, smd_result_t *result);
+int smd_encode_buffer(const unsigned char *bin_data, size_t bin_size, unsigned char *smd_data, size_t smd_capacity, int flags, smd_result_t *result);
+// BIN header contents (the image must be at least BIN_CHECKSUM_START bytes long)
+void smd_read_bin_header(const unsigned char *bin_data, smd_result_t *result);
+const char *smd_strerror(int status);
+
+// Layout Engine
+// layouts table, terminated by an entry with a NULL name
+extern const smd_layout_t smd_layouts[];
+const smd_layout_t *smd_find_layout(const char *name);
+const smd_layout_t *smd_layout_for_format(int format);
+// size of the BIN image decoded with a layout (0 if the image does not fit the layout)
+size_t smd_layout_decoded_size(const smd_layout_t *layout, const unsigned char *data, size_t size);
+int smd_decode_layout(const smd_layout_t *layout, const unsigned char *data, size_t size, unsigned char *bin_data, size_t bin_capacity, int flags, smd_result_t *result);
+
+// Format Detection
+int smd_detect_format(const unsigned char *data, size_t size, smd_detection_t *detection);
+const char *smd_format_name(int format);
+
+#endif
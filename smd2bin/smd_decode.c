@@ -10,21 +10,39 @@
 //
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "smd_decode.h"
 
 // Variables
 char *filename = NULL;
 char *output_filename = NULL;
+char *batch_source = NULL;
+char *layout_name = NULL;
+int batch_threads = 0;
 FILE *SMD_ROM_FILE;
 FILE *BIN_ROM_FILE;
 int option;
+int use_mmap = 0;
+int use_stream = 0;
+int use_split = 0;
+int use_encode = 0;
+int use_detect = 0;
+int stdout_data_fd = -1;
 smd_header_t header;
 unsigned char *bin_data;
+rom_digest_t rom_digest;
 
 // pretty banner
 void pretty_banner()
@@ -41,6 +59,14 @@ int usage(char *prgname)
     printf("%s\n", "SMD_Convert");
     printf("%s", "Program Usage:\n");
     printf("\t%s %s", prgname, " -c filename.smd [-o <output bin romfile>]\n");
+    printf("\t%s %s", prgname, " -m -c filename.smd [-o <output bin romfile>] (memory mapped I/O)\n");
+    printf("\t%s %s", prgname, " -f <smd|32x|mgd|auto> -c filename [-o <output bin romfile>] (copier layout, memory mapped I/O)\n");
+    printf("\t%s %s", prgname, " -s -c <filename.smd|-> [-o <output bin romfile|->] (streaming, '-' is stdin/stdout)\n");
+    printf("\t%s %s", prgname, " -e -c <filename.bin|-> -o <output smd romfile|-> (encode BIN to SMD)\n");
+    printf("\t%s %s", prgname, " -S -c <first part (e.g. GAME.1A)> [-o <output bin romfile>] (split ROM set)\n");
+    printf("\t%s %s", prgname, " -b <directory|file list> [-o <output directory>] [-j <threads>] (batch conversion)\n");
+    printf("\t%s %s", prgname, " -D [files...] (detect SMD/BIN/MGD format, reads paths from stdin if no file is given)\n");
+    printf("\t%s %s", prgname, " -t (run deinterleave kernels self test)\n");
     printf(" ");
     exit(0);
 }
@@ -64,11 +90,7 @@ smd_header_t read_smd_header_from_file(FILE *romfile)
         fread(header_data, 1, SMD_HEADER_SIZE, romfile);
 
         // decode fields
-        local_header.interleaved_blocks_num = (int)(*(header_data + NUM_BLOCK_OFFSET));
-        local_header.is_split_rom = (int)(*(header_data + SPLIT_ROM_OFFSET));
-        local_header.binary_size = local_header.interleaved_blocks_num * SMD_ROM_BLOCK_SIZE;
-        local_header.magic_num[0] = (unsigned char)(*(header_data + SMD_MAGIC_OFFSET));
-        local_header.magic_num[1] = (unsigned char)(*(header_data + SMD_MAGIC_OFFSET + 1));
+        local_header = smd_decode_header(header_data);
 
         // good, release resources..
         if (header_data != NULL )
@@ -82,7 +104,7 @@ smd_header_t read_smd_header_from_file(FILE *romfile)
 int decode_smd_header(smd_header_t header)
 {
         // test magic number number
-        if ((header.magic_num[0] != 0xAA) || (header.magic_num[1] != 0xBB)) // header corrupted or not SMD format
+        if (smd_check_header(header) < 0)
         {
             printf ("%s\n", "|KO|---!> File is not in SMD format or SMD header corrupted.");
             return -1;
@@ -102,41 +124,128 @@ int decode_smd_header(smd_header_t header)
         return 0;
 }
 
-// read ROM binary data and deinterleave data blocks
-unsigned char *deinterleave_data_blocks(FILE *smd_file, smd_header_t smd_header)
+// round trip a small canonical SMD image through the selected kernel
+int run_roundtrip_selftest()
 {
-    // local pointers
-    // interleaved byte swap-counters
-    int even_byte_counter, odd_byte_counter;
-    // byte-buffer pointers
-    int counter, inner_loop_counter, step, data_read;
+    static unsigned char smd_image[SMD_HEADER_SIZE + (SELFTEST_IMAGE_BLOCKS * SMD_ROM_BLOCK_SIZE)];
+    static unsigned char bin_image[SELFTEST_IMAGE_BLOCKS * SMD_ROM_BLOCK_SIZE];
+    static unsigned char encoded_image[SMD_HEADER_SIZE + (SELFTEST_IMAGE_BLOCKS * SMD_ROM_BLOCK_SIZE)];
+    smd_result_t result;
+    size_t i;
 
-    // allocate memory for the SMD-to-BIN unpack and conversion process
-    unsigned char *binary_data = (unsigned char *)malloc(smd_header.binary_size);
-    if (binary_data == NULL)
+    // x: canonical header + random data blocks
+    srand(0xB1A5);
+    memset(smd_image, 0x00, SMD_HEADER_SIZE);
+    smd_image[NUM_BLOCK_OFFSET] = SELFTEST_IMAGE_BLOCKS;
+    smd_image[FILE_TYPE_OFFSET] = SMD_FILE_TYPE_PROGRAM;
+    smd_image[SMD_MAGIC_OFFSET] = 0xAA;
+    smd_image[SMD_MAGIC_OFFSET + 1] = 0xBB;
+    for (i = SMD_HEADER_SIZE; i < sizeof(smd_image); i++)
+        smd_image[i] = (unsigned char)rand();
+
+    // encode(decode(x)), through the library API
+    if ((smd_decode_buffer(smd_image, sizeof(smd_image), bin_image, sizeof(bin_image), 0, &result) != SMD_OK) ||
+        (smd_encode_buffer(bin_image, result.bin_size, encoded_image, sizeof(encoded_image), 0, &result) != SMD_OK) ||
+        (memcmp(smd_image, encoded_image, sizeof(smd_image)) != 0))
     {
-        printf("%s\n", "Out Of Memory.");
-        exit(-1);
+        printf("\t%-8s %s\n", "image", "KO: encode(decode(x)) != x");
+        return -1;
     }
-    memset(binary_data, 0x0, smd_header.binary_size);
+    printf("\t%-8s %s\n", "image", "OK (encode(decode(x)) == x)");
+    return 0;
+}
+
+// check every supported kernel against the reference loops:
+// decode and encode must match the reference output and encode(decode(x)) must give back x
+int run_deinterleave_selftest()
+{
+    unsigned char src[SMD_ROM_BLOCK_SIZE];
+    unsigned char expected[SMD_ROM_BLOCK_SIZE];
+    unsigned char decoded[SMD_ROM_BLOCK_SIZE];
+    unsigned char encoded[SMD_ROM_BLOCK_SIZE];
+    const deinterleave_kernel_t *kernel;
+    const char *failure;
+    int k, round, i, n, failures = 0;
 
-    // allocate block data holder
-    unsigned char *data_block = (unsigned char *)malloc(SMD_ROM_BLOCK_SIZE * sizeof(unsigned char));
-    if (data_block == NULL)
+    printf("%s\n", "|BUSY|---> Running deinterleave kernels self test...");
+    for (k = 0; (kernel = smd_kernel(k)) != NULL; k++)
     {
-        if (binary_data != NULL)
-            free(binary_data);
+        if (!kernel->supported())
+        {
+            printf("\t%-8s %s\n", kernel->name, "SKIPPED (not supported by this CPU)");
+            continue;
+        }
 
-        printf("%s\n", "Out Of Memory.");
-        exit(-1);
+        srand(0x5E6A);
+        failure = NULL;
+        for (round = 0; (round < SELFTEST_ROUNDS) && (failure == NULL); round++)
+        {
+            // first round uses an index pattern, then random data
+            for (i = 0; i < SMD_ROM_BLOCK_SIZE; i++)
+                src[i] = (round == 0) ? (unsigned char)(i ^ (i >> 8)) : (unsigned char)rand();
+
+            // decoder
+            smd_deinterleave_block_reference(expected, src);
+            memset(decoded, 0x00, SMD_ROM_BLOCK_SIZE);
+            kernel->decode(decoded, src);
+            if (memcmp(expected, decoded, SMD_ROM_BLOCK_SIZE) != 0)
+                failure = "decoder output mismatch";
+
+            // round trip
+            memset(encoded, 0x00, SMD_ROM_BLOCK_SIZE);
+            kernel->encode(encoded, decoded);
+            if ((failure == NULL) && (memcmp(src, encoded, SMD_ROM_BLOCK_SIZE) != 0))
+                failure = "encode(decode(x)) != x";
+
+            // encoder (src used as BIN data)
+            smd_interleave_block_reference(expected, src);
+            kernel->encode(encoded, src);
+            if ((failure == NULL) && (memcmp(expected, encoded, SMD_ROM_BLOCK_SIZE) != 0))
+                failure = "encoder output mismatch";
+
+            // zip/unzip on halves of any length (vector loop + scalar tail)
+            n = (round * 131) % SMD_BANK_MID_POINT;
+            for (i = 0; i < n; i++)
+            {
+                expected[SMD_INTERLEAVE_STEP * i] = src[SMD_BANK_MID_POINT + i];
+                expected[SMD_INTERLEAVE_STEP * i + 1] = src[i];
+            }
+            kernel->zip(decoded, src + SMD_BANK_MID_POINT, src, n);
+            if ((failure == NULL) && (memcmp(expected, decoded, SMD_INTERLEAVE_STEP * n) != 0))
+                failure = "zip output mismatch";
+            kernel->unzip(encoded + SMD_BANK_MID_POINT, encoded, decoded, n);
+            if ((failure == NULL) && ((memcmp(src, encoded, n) != 0) || (memcmp(src + SMD_BANK_MID_POINT, encoded + SMD_BANK_MID_POINT, n) != 0)))
+                failure = "unzip(zip(x)) != x";
+        }
+
+        if (failure == NULL)
+        {
+            printf("\t%-8s %s\n", kernel->name, "OK");
+        }
+        else
+        {
+            printf("\t%-8s %s: %s %d\n", kernel->name, "KO", failure, round - 1);
+            failures++;
+        }
     }
-    memset(data_block, 0x0, (SMD_ROM_BLOCK_SIZE * sizeof(unsigned char)));
 
-    // begin decoding....
-    printf("%s\n", "|OK|---> Beginning Data Decoding Process....");
-    fseek(smd_file, SMD_HEADER_SIZE, SEEK_SET);
-    step=0;
-    for (counter=0; counter < smd_header.interleaved_blocks_num; counter++)
+    // whole image: a canonical SMD dump must survive a decode/encode round trip, header included
+    if (run_roundtrip_selftest() < 0)
+        failures++;
+
+    printf("%s %s\n", "|INFO|---> Selected kernel:", smd_select_kernel()->name);
+    return (failures == 0) ? 0 : -1;
+}
+
+// deinterleave data blocks from the current position of an SMD file into binary_data.
+// when digest is not NULL each block is digested right after being decoded.
+// returns the number of complete blocks decoded (no output, safe to call from worker threads)
+int decode_smd_blocks(FILE *smd_file, int blocks, unsigned char *binary_data, rom_digest_t *digest)
+{
+    unsigned char data_block[SMD_ROM_BLOCK_SIZE];
+    int counter, data_read;
+
+    for (counter=0; counter < blocks; counter++)
     {
         // read a data block
         data_read = fread(data_block, SMD_ROM_BLOCK_SIZE, 1, smd_file);
@@ -145,44 +254,53 @@ unsigned char *deinterleave_data_blocks(FILE *smd_file, smd_header_t smd_header)
             printf("|INFO|----> %s%d (Data Read: %d Bytes)...\n", "ROM BANK #", counter, data_read*SMD_ROM_BLOCK_SIZE);
         #endif
 
-        // reset byte counters
-        even_byte_counter = 0;
-        odd_byte_counter = 1;
+        if (data_read != 1)
+            break;
 
         // deinterleave ROM
-        for (inner_loop_counter=0; inner_loop_counter < SMD_ROM_BLOCK_SIZE; inner_loop_counter++)
-        {
-            if (inner_loop_counter < SMD_BANK_MID_POINT)
-            {
-                *(binary_data + step + odd_byte_counter) = (unsigned char)(*(data_block + inner_loop_counter));
-                odd_byte_counter += SMD_INTERLEAVE_STEP;
-            }
-            else
-            {
-                *(binary_data + step + even_byte_counter) = (unsigned char)(*(data_block + inner_loop_counter));
-                even_byte_counter += SMD_INTERLEAVE_STEP;
-            }
-        }
+        smd_decode_blocks(binary_data + ((size_t)counter * SMD_ROM_BLOCK_SIZE), data_block, 1, digest);
+    }
+
+    return counter;
+}
+
+// read ROM binary data and deinterleave data blocks
+unsigned char *deinterleave_data_blocks(FILE *smd_file, smd_header_t smd_header, rom_digest_t *digest)
+{
+    int counter;
 
-        // advance one block in the deinterleaved binary data buffer
-        step += SMD_ROM_BLOCK_SIZE;
+    // allocate memory for the SMD-to-BIN unpack and conversion process
+    unsigned char *binary_data = (unsigned char *)malloc(smd_header.binary_size);
+    if (binary_data == NULL)
+    {
+        printf("%s\n", "Out Of Memory.");
+        exit(-1);
     }
+    memset(binary_data, 0x0, smd_header.binary_size);
 
-    // free data buffers...
-    if (data_block != NULL)
-        free(data_block);
+    // begin decoding....
+    printf("%s\n", "|OK|---> Beginning Data Decoding Process....");
+    printf("%s %s\n", "|INFO|---> Deinterleave kernel:", smd_select_kernel()->name);
+    fseek(smd_file, SMD_HEADER_SIZE, SEEK_SET);
+    smd_digest_init(digest);
+    counter = decode_smd_blocks(smd_file, smd_header.interleaved_blocks_num, binary_data, digest);
+    smd_digest_final(digest);
 
     // OK, return deinterleaved data
     printf("%s\n", "|OK|---> Decoding DONE.");
-    printf("%s 0x%X (size: %dKB)\n", "|OK|---> Decoded data at address: ", (unsigned int)binary_data, (counter*SMD_ROM_BLOCK_SIZE)/1024);
+    printf("%s %p (size: %dKB)\n", "|OK|---> Decoded data at address: ", (void *)binary_data, (counter*SMD_ROM_BLOCK_SIZE)/1024);
     return (unsigned char *)binary_data;
 }
 
 // write BIN format ROM Dump file
-int write_bin_rom_file(unsigned char *converted_data, FILE *outfile)
+int write_bin_rom_file(unsigned char *converted_data, size_t size, FILE *outfile)
 {
         printf("%s\n", "|BUSY|---> Writing converted ROM Image File (RAW BINary Format)...");
-        fwrite(converted_data, header.binary_size, 1, outfile);
+        if (fwrite(converted_data, size, 1, outfile) != 1)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> write_bin_rom_file(): fwrite() error!", errno);
+            return -1;
+        }
 
         // done
         printf("%s\n", "|OK|---> Conversion Complete.");
@@ -190,33 +308,14 @@ int write_bin_rom_file(unsigned char *converted_data, FILE *outfile)
 }
 
 // read converted bin rom header
-int parse_bin_rom_header(unsigned char *binary_data)
+int parse_bin_rom_header(unsigned char *binary_data, rom_digest_t *digest)
 {
         // binary rom header data holder
-        bin_header_t binary_rom_header;
-
-        // initialize fields...
-        binary_rom_header.system_name = (char *)malloc((SYSTEM_STR_LEN * sizeof(char)) + 1 );
-        binary_rom_header.software_name = (char *)malloc((SWNAME_STR_LEN * sizeof(char)) + 1);
-        binary_rom_header.copyright_notice = (char *)malloc((COPYRIGHT_NOTICE_LEN * sizeof(char)) + 1);
-        binary_rom_header.regional_lockout = (char *)malloc((LOCKDOWN_CODE_LEN * sizeof(char)) + 1);
-        memset(binary_rom_header.system_name, 0x00, SYSTEM_STR_LEN + 1);
-        memset(binary_rom_header.software_name, 0x00, SWNAME_STR_LEN + 1);
-        memset(binary_rom_header.copyright_notice, 0x00, COPYRIGHT_NOTICE_LEN + 1);
-        memset(binary_rom_header.regional_lockout, 0x00, LOCKDOWN_CODE_LEN + 1);
-
-        // sanity check
-        if ((binary_rom_header.system_name == NULL) || (binary_rom_header.software_name == NULL) || (binary_rom_header.copyright_notice == NULL) || (binary_rom_header.regional_lockout == NULL))
-        {
-            printf("%s\n", "Out Of Memory.");
-            return -1;
-        }
+        smd_result_t binary_rom_header;
+        int i;
 
         // read data
-        memcpy(binary_rom_header.system_name, (unsigned char*)(binary_data + BIN_SYSTEM_NAME_OFFSET), SYSTEM_STR_LEN);
-        memcpy(binary_rom_header.software_name, (unsigned char*)(binary_data + BIN_SOFTWARE_TITLE_DOMESTIC), SWNAME_STR_LEN);
-        memcpy(binary_rom_header.copyright_notice, (unsigned char*)(binary_data + BIN_SW_COPYRIGHT_NOTICE), COPYRIGHT_NOTICE_LEN);
-        memcpy(binary_rom_header.regional_lockout, (unsigned char*)(binary_data + BIN_SOFTWARE_LOCK_CODE), LOCKDOWN_CODE_LEN);
+        smd_read_bin_header(binary_data, &binary_rom_header);
 
         // display info
         printf("\n");
@@ -225,17 +324,991 @@ int parse_bin_rom_header(unsigned char *binary_data)
         printf("\t%s %s\n", "SOFTWARE TITLE: ", binary_rom_header.software_name);
         printf("\t%s %s\n", "COPYRIGHT NOTICE: ", binary_rom_header.copyright_notice);
         printf("\t%s %s\n", "REGIONAL CODE: ", binary_rom_header.regional_lockout);
-
-        // free resources
-        free(binary_rom_header.system_name);
-        free(binary_rom_header.software_name);
-        free(binary_rom_header.copyright_notice);
-        free(binary_rom_header.regional_lockout);
+        if (digest != NULL)
+        {
+            printf("\t%s 0x%04X (%s 0x%04X) %s\n", "CHECKSUM: ", binary_rom_header.stored_checksum, "computed:", digest->checksum,
+                   (binary_rom_header.stored_checksum == digest->checksum) ? "OK" : "MISMATCH");
+            printf("\t%s %08X\n", "CRC32: ", digest->crc32);
+            printf("\t%s ", "SHA-1: ");
+            for (i = 0; i < SHA1_DIGEST_LEN; i++)
+                printf("%02x", digest->sha1[i]);
+            printf("\n");
+            if (binary_rom_header.stored_checksum != digest->checksum)
+                printf("%s\n", "|WARNING|---> Header checksum does not match ROM contents.");
+        }
 
         // ok done
         return 0;
 }
 
+// zero-copy conversion: decode blocks straight from a read-only mapping of the SMD file
+// into a shared mapping of the (pre-sized) output file. No intermediate buffers.
+// if no output file is given, the ROM is decoded into an anonymous mapping.
+// any copier layout is accepted, a NULL layout is detected from the file contents.
+int convert_smd_mmap(const char *smd_filename, const char *bin_filename, const smd_layout_t *layout)
+{
+    int smd_fd, bin_fd = -1, status, ret = -1;
+    struct stat smd_stats;
+    unsigned char *smd_map = MAP_FAILED, *bin_map = MAP_FAILED;
+    size_t bin_size = 0;
+    smd_result_t result;
+    smd_detection_t detection;
+
+    smd_fd = open(smd_filename, O_RDONLY);
+    if (smd_fd < 0)
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_mmap(): open() error! Cannot Open Specified file.", errno);
+        return -1;
+    }
+    if ((fstat(smd_fd, &smd_stats) < 0) || (smd_stats.st_size < SMD_HEADER_SIZE))
+    {
+        printf("%s\n", "|KO|---> convert_smd_mmap(): File too short to contain an SMD header.");
+        goto cleanup;
+    }
+
+    smd_map = (unsigned char *)mmap(NULL, smd_stats.st_size, PROT_READ, MAP_PRIVATE, smd_fd, 0);
+    if (smd_map == MAP_FAILED)
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_mmap(): mmap() error on SMD file.", errno);
+        goto cleanup;
+    }
+
+    // guess the copier layout
+    if (layout == NULL)
+    {
+        smd_detect_format(smd_map, smd_stats.st_size, &detection);
+        layout = smd_layout_for_format(detection.format);
+        if (layout == NULL)
+        {
+            printf("%s %s\n", "|KO|---> convert_smd_mmap(): No copier layout for detected format", smd_format_name(detection.format));
+            goto cleanup;
+        }
+        printf("%s: %s (%d%%)\n", "|OK|---> Detected Format", smd_format_name(detection.format), detection.confidence);
+    }
+    printf("%s: %s\n", "|OK|---> Copier Layout", layout->name);
+    madvise(smd_map, smd_stats.st_size, MADV_SEQUENTIAL);
+
+    // read and check SMD ROM header
+    if (layout->smd_header)
+    {
+        header = smd_decode_header(smd_map);
+        if (decode_smd_header(header) < 0)
+            goto cleanup;
+    }
+
+    bin_size = smd_layout_decoded_size(layout, smd_map, smd_stats.st_size);
+    if (bin_size == 0)
+    {
+        printf("%s\n", "|KO|---> convert_smd_mmap(): ROM file is truncated or contains no data blocks.");
+        goto cleanup;
+    }
+
+    // map destination
+    if (bin_filename != NULL)
+    {
+        printf("%s: %s\n", "|OK|---> Mapping new ROM Image File", bin_filename);
+        bin_fd = open(bin_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if ((bin_fd < 0) || (ftruncate(bin_fd, bin_size) < 0))
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_mmap(): Cannot create output file.", errno);
+            goto cleanup;
+        }
+        bin_map = (unsigned char *)mmap(NULL, bin_size, PROT_READ | PROT_WRITE, MAP_SHARED, bin_fd, 0);
+    }
+    else
+    {
+        bin_map = (unsigned char *)mmap(NULL, bin_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (bin_map == MAP_FAILED)
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_mmap(): mmap() error on output image.", errno);
+        goto cleanup;
+    }
+
+    // decode straight from mapping to mapping
+    printf("%s\n", "|OK|---> Beginning Data Decoding Process (memory mapped)....");
+    status = smd_decode_layout(layout, smd_map, smd_stats.st_size, bin_map, bin_size, SMD_FLAG_DIGEST, &result);
+    if (status != SMD_OK)
+    {
+        printf("%s %s\n", "|KO|---> convert_smd_mmap():", smd_strerror(status));
+        goto cleanup;
+    }
+    printf("%s %s\n", "|INFO|---> Deinterleave kernel:", result.kernel);
+    printf("%s (size: %dKB)\n", "|OK|---> Decoding DONE.", (int)(bin_size / 1024));
+
+    // decode the BIN Header
+    if (parse_bin_rom_header(bin_map, &result.digest) < 0)
+        goto cleanup;
+
+    if (bin_filename != NULL)
+    {
+        if (msync(bin_map, bin_size, MS_SYNC) < 0)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_mmap(): msync() error on output image.", errno);
+            goto cleanup;
+        }
+        printf("%s\n", "|OK|---> Conversion Complete.");
+    }
+    else
+    {
+        printf("\n%s\n", "|NOTICE|---> No output filename specified and decode finished. Exiting...");
+    }
+    ret = 0;
+
+cleanup:
+    if (bin_map != MAP_FAILED)
+        munmap(bin_map, bin_size);
+    if (smd_map != MAP_FAILED)
+        munmap(smd_map, smd_stats.st_size);
+    if (bin_fd >= 0)
+        close(bin_fd);
+    close(smd_fd);
+    return ret;
+}
+
+// route log messages to stderr, so that stdout can carry ROM data.
+// returns a descriptor for the original stdout.
+int detach_stdout_for_data()
+{
+    int data_fd;
+
+    fflush(stdout);
+    data_fd = dup(STDOUT_FILENO);
+    if (data_fd >= 0)
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    return data_fd;
+}
+
+// streaming conversion: decode and emit one 16KB block at a time, memory use is constant.
+// '-' selects stdin/stdout, so the converter can be used inside shell pipelines.
+// the one-byte block count in the header overflows for ROMs bigger than 4MB: when the input
+// size is known, the block count is derived from the file size instead.
+int convert_smd_stream(const char *smd_filename, const char *bin_filename)
+{
+    static unsigned char header_data[SMD_HEADER_SIZE];
+    static unsigned char data_block[SMD_ROM_BLOCK_SIZE];
+    static unsigned char bin_block[SMD_ROM_BLOCK_SIZE];
+    static unsigned char bin_header_block[SMD_ROM_BLOCK_SIZE];
+    rom_digest_t digest;
+    FILE *smd_file = stdin, *bin_file = NULL;
+    struct stat smd_stats;
+    unsigned long expected_blocks = 0, blocks_done = 0, size_blocks;
+    size_t data_read;
+    int size_known = 0, ret = -1;
+
+    // open streams
+    if (strcmp(smd_filename, "-") != 0)
+    {
+        smd_file = fopen(smd_filename, "rb");
+        if (smd_file == NULL)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_stream(): fopen() error! Cannot Open Specified file.", errno);
+            return -1;
+        }
+    }
+    if (bin_filename != NULL)
+    {
+        if (strcmp(bin_filename, "-") == 0)
+        {
+            bin_file = fdopen(stdout_data_fd, "wb");
+        }
+        else
+        {
+            bin_file = fopen(bin_filename, "wb");
+        }
+        if (bin_file == NULL)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_stream(): Cannot open output stream.", errno);
+            goto cleanup;
+        }
+    }
+
+    // read and check SMD ROM header
+    if (fread(header_data, 1, SMD_HEADER_SIZE, smd_file) != SMD_HEADER_SIZE)
+    {
+        printf("%s\n", "|KO|---> convert_smd_stream(): Input too short to contain an SMD header.");
+        goto cleanup;
+    }
+    header = smd_decode_header(header_data);
+    if (decode_smd_header(header) < 0)
+        goto cleanup;
+
+    // figure out how many blocks to expect
+    expected_blocks = (unsigned long)header.interleaved_blocks_num;
+    if ((fstat(fileno(smd_file), &smd_stats) == 0) && S_ISREG(smd_stats.st_mode))
+    {
+        size_known = 1;
+        size_blocks = smd_block_count(header, (unsigned long)(smd_stats.st_size - SMD_HEADER_SIZE));
+        // a regular file must hold every block, like the other conversion modes require
+        if (size_blocks < expected_blocks)
+        {
+            printf("%s %lu/%lu\n", "|KO|---> convert_smd_stream(): SMD file is truncated, blocks available:", size_blocks, expected_blocks);
+            goto cleanup;
+        }
+        if (((unsigned long)(smd_stats.st_size - SMD_HEADER_SIZE) % SMD_ROM_BLOCK_SIZE) != 0)
+        {
+            printf("%s %lu %s\n", "|KO|---> convert_smd_stream(): SMD file ends with", (unsigned long)((smd_stats.st_size - SMD_HEADER_SIZE) % SMD_ROM_BLOCK_SIZE), "trailing bytes (incomplete block).");
+            goto cleanup;
+        }
+        if (size_blocks > expected_blocks)
+            printf("%s %lu\n", "|NOTICE|---> Header block count overflowed, blocks derived from file size:", size_blocks);
+        expected_blocks = size_blocks;
+    }
+
+    // decode block by block
+    smd_digest_init(&digest);
+    printf("%s\n", "|OK|---> Beginning Data Decoding Process (streaming)....");
+    printf("%s %s\n", "|INFO|---> Deinterleave kernel:", smd_select_kernel()->name);
+    while (!size_known || (blocks_done < expected_blocks))
+    {
+        data_read = fread(data_block, 1, SMD_ROM_BLOCK_SIZE, smd_file);
+        if (data_read < SMD_ROM_BLOCK_SIZE)
+        {
+            // the file shrank while being read
+            if (size_known)
+            {
+                printf("%s %lu/%lu\n", "|KO|---> convert_smd_stream(): Short read, blocks decoded:", blocks_done, expected_blocks);
+                goto cleanup;
+            }
+            if (data_read > 0)
+                printf("%s %lu %s\n", "|NOTICE|---> Ignoring", (unsigned long)data_read, "trailing bytes (incomplete block).");
+            break;
+        }
+
+        smd_decode_blocks(bin_block, data_block, 1, &digest);
+
+        // first block holds the BIN header, shown once the digests are complete
+        if (blocks_done == 0)
+            memcpy(bin_header_block, bin_block, SMD_ROM_BLOCK_SIZE);
+
+        if ((bin_file != NULL) && (fwrite(bin_block, SMD_ROM_BLOCK_SIZE, 1, bin_file) != 1))
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_stream(): Write error on output stream.", errno);
+            goto cleanup;
+        }
+        blocks_done++;
+    }
+
+    if (ferror(smd_file))
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_stream(): Read error on input stream.", errno);
+        goto cleanup;
+    }
+    if (!size_known && (blocks_done != (unsigned long)header.interleaved_blocks_num))
+    {
+        if ((blocks_done & 0xFF) == (unsigned long)header.interleaved_blocks_num)
+            printf("%s %lu\n", "|NOTICE|---> Header block count overflowed, blocks read from stream:", blocks_done);
+        else
+            printf("%s %lu\n", "|NOTICE|---> Block count mismatch with SMD header, blocks read from stream:", blocks_done);
+    }
+    printf("\n%s %lu %s (size: %luKB)\n", "|OK|---> Decoding DONE,", blocks_done, "blocks", (blocks_done * SMD_ROM_BLOCK_SIZE) / 1024);
+
+    if (blocks_done == 0)
+        goto cleanup;
+    smd_digest_final(&digest);
+    if (parse_bin_rom_header(bin_header_block, &digest) < 0)
+        goto cleanup;
+
+    if (bin_file != NULL)
+    {
+        if (fflush(bin_file) != 0)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_stream(): Write error on output stream.", errno);
+            goto cleanup;
+        }
+        printf("%s\n", "|OK|---> Conversion Complete.");
+    }
+    else
+    {
+        printf("\n%s\n", "|NOTICE|---> No output filename specified and decode finished. Exiting...");
+    }
+    ret = 0;
+
+cleanup:
+    if (bin_file != NULL)
+        fclose(bin_file);
+    if (smd_file != stdin)
+        fclose(smd_file);
+    return ret;
+}
+
+// BIN-to-SMD encoding, one 16KB block at a time ('-' selects stdin/stdout).
+// the block count goes in the header before the data: it is taken from the input size
+// or, for pipes, patched into the header at the end (the output must then be seekable).
+int convert_bin_to_smd(const char *bin_filename, const char *smd_filename)
+{
+    static unsigned char header_data[SMD_HEADER_SIZE];
+    static unsigned char bin_block[SMD_ROM_BLOCK_SIZE];
+    static unsigned char smd_block[SMD_ROM_BLOCK_SIZE];
+    FILE *bin_file = stdin, *smd_file = NULL;
+    struct stat bin_stats;
+    unsigned long expected_blocks = 0, blocks_done = 0;
+    size_t data_read;
+    int size_known = 0, ret = -1;
+
+    // open streams
+    if (strcmp(bin_filename, "-") != 0)
+    {
+        bin_file = fopen(bin_filename, "rb");
+        if (bin_file == NULL)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_bin_to_smd(): fopen() error! Cannot Open Specified file.", errno);
+            return -1;
+        }
+    }
+    if (smd_filename == NULL)
+    {
+        printf("%s\n", "|KO|---> convert_bin_to_smd(): No output filename specified.");
+        goto cleanup;
+    }
+    smd_file = (strcmp(smd_filename, "-") == 0) ? fdopen(stdout_data_fd, "wb") : fopen(smd_filename, "wb");
+    if (smd_file == NULL)
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_bin_to_smd(): Cannot open output stream.", errno);
+        goto cleanup;
+    }
+
+    if ((fstat(fileno(bin_file), &bin_stats) == 0) && S_ISREG(bin_stats.st_mode))
+    {
+        size_known = 1;
+        expected_blocks = ((unsigned long)bin_stats.st_size + SMD_ROM_BLOCK_SIZE - 1) / SMD_ROM_BLOCK_SIZE;
+        if (((unsigned long)bin_stats.st_size % SMD_ROM_BLOCK_SIZE) != 0)
+            printf("%s\n", "|NOTICE|---> BIN image is not a multiple of 16KB, the last block will be padded.");
+        if (expected_blocks > 0xFF)
+            printf("%s\n", "|NOTICE|---> More than 255 blocks: the header block count overflows.");
+    }
+    else if (fseek(smd_file, 0L, SEEK_CUR) != 0)
+    {
+        printf("%s\n", "|KO|---> convert_bin_to_smd(): Input size unknown and output not seekable: cannot write the block count.");
+        goto cleanup;
+    }
+
+    smd_encode_header(header_data, expected_blocks, 0);
+    if (fwrite(header_data, SMD_HEADER_SIZE, 1, smd_file) != 1)
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_bin_to_smd(): Write error on output stream.", errno);
+        goto cleanup;
+    }
+
+    // encode block by block
+    printf("%s\n", "|OK|---> Beginning Data Encoding Process (streaming)....");
+    printf("%s %s\n", "|INFO|---> Interleave kernel:", smd_select_kernel()->name);
+    while ((data_read = fread(bin_block, 1, SMD_ROM_BLOCK_SIZE, bin_file)) > 0)
+    {
+        if (data_read < SMD_ROM_BLOCK_SIZE)
+            memset(bin_block + data_read, SMD_PADDING_BYTE, SMD_ROM_BLOCK_SIZE - data_read);
+
+        // first block holds the BIN header
+        if ((blocks_done == 0) && (data_read >= BIN_CHECKSUM_START) && (parse_bin_rom_header(bin_block, NULL) < 0))
+            goto cleanup;
+
+        smd_encode_blocks(smd_block, bin_block, 1);
+        if (fwrite(smd_block, SMD_ROM_BLOCK_SIZE, 1, smd_file) != 1)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_bin_to_smd(): Write error on output stream.", errno);
+            goto cleanup;
+        }
+        blocks_done++;
+        if (data_read < SMD_ROM_BLOCK_SIZE)
+            break;
+    }
+    if (ferror(bin_file))
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_bin_to_smd(): Read error on input stream.", errno);
+        goto cleanup;
+    }
+    if (blocks_done == 0)
+    {
+        printf("%s\n", "|KO|---> convert_bin_to_smd(): Empty BIN image.");
+        goto cleanup;
+    }
+
+    // fix up the block count when the input size was not known in advance
+    if (!size_known || (blocks_done != expected_blocks))
+    {
+        smd_encode_header(header_data, blocks_done, 0);
+        if ((fseek(smd_file, 0L, SEEK_SET) != 0) || (fwrite(header_data, SMD_HEADER_SIZE, 1, smd_file) != 1))
+        {
+            printf("%s\n", "|KO|---> convert_bin_to_smd(): Cannot update the SMD header block count.");
+            goto cleanup;
+        }
+    }
+
+    if (fflush(smd_file) != 0)
+    {
+        printf("%s (ERRNO: %d)\n", "|KO|---> convert_bin_to_smd(): Write error on output stream.", errno);
+        goto cleanup;
+    }
+    printf("\n%s %lu %s (size: %luKB)\n", "|OK|---> Encoding DONE,", blocks_done, "blocks", (blocks_done * SMD_ROM_BLOCK_SIZE) / 1024);
+    ret = 0;
+
+cleanup:
+    if (smd_file != NULL)
+        fclose(smd_file);
+    if (bin_file != stdin)
+        fclose(bin_file);
+    return ret;
+}
+
+// FORMAT DETECTION
+// classify one file: the file is mapped and only the sampled pages are read
+int detect_file_format(const char *path, smd_detection_t *detection)
+{
+    struct stat file_stats;
+    unsigned char *file_map;
+    int fd, status = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if ((fstat(fd, &file_stats) == 0) && S_ISREG(file_stats.st_mode) && (file_stats.st_size > 0))
+    {
+        file_map = (unsigned char *)mmap(NULL, file_stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file_map != MAP_FAILED)
+        {
+            madvise(file_map, file_stats.st_size, MADV_RANDOM);
+            status = smd_detect_format(file_map, file_stats.st_size, detection);
+            munmap(file_map, file_stats.st_size);
+        }
+    }
+    close(fd);
+    return status;
+}
+
+void print_detection(const char *path)
+{
+    smd_detection_t detection;
+
+    if (detect_file_format(path, &detection) < 0)
+        printf("%-8s %4s  %s\n", "ERROR", "-", path);
+    else
+        printf("%-8s %3d%%  %s\n", smd_format_name(detection.format), detection.confidence, path);
+}
+
+// detect the format of every file given on the command line, or listed on stdin
+int detect_formats(int count, char **paths)
+{
+    char path[BATCH_PATH_LEN];
+    size_t len;
+    int i;
+
+    for (i = 0; i < count; i++)
+        print_detection(paths[i]);
+
+    if (count == 0)
+    {
+        while (fgets(path, sizeof(path), stdin) != NULL)
+        {
+            len = strlen(path);
+            while ((len > 0) && ((path[len - 1] == '\n') || (path[len - 1] == '\r')))
+                path[--len] = '\0';
+            if (len > 0)
+                print_detection(path);
+        }
+    }
+
+    return 0;
+}
+
+// SPLIT ROM SETS
+// derive the file name of the next part of a split set, by incrementing the
+// last character of the extension (GAME.1A -> GAME.1B, GAME.001 -> GAME.002)
+// or, for .smd files, the last character of the name (GAMEA.SMD -> GAMEB.SMD)
+char *next_split_part_name(const char *path)
+{
+    char *next = strdup(path);
+    char *ext, *counter;
+
+    if (next == NULL)
+        return NULL;
+
+    ext = strrchr(next, '.');
+    if ((ext == NULL) || (strchr(ext, '/') != NULL))
+        counter = next + strlen(next) - 1;
+    else if (strcasecmp(ext, SMD_FILE_EXTENSION) == 0)
+        counter = ext - 1;
+    else
+        counter = next + strlen(next) - 1;
+
+    if ((counter < next) || (*counter == 'z') || (*counter == 'Z') || (*counter == '9') ||
+        !(((*counter >= 'a') && (*counter <= 'z')) || ((*counter >= 'A') && (*counter <= 'Z')) || ((*counter >= '0') && (*counter <= '9'))))
+    {
+        free(next);
+        return NULL;
+    }
+
+    (*counter)++;
+    return next;
+}
+
+// find all parts of a split set starting from the first one and validate their headers.
+// returns the number of parts, or -1 if the set is broken.
+int discover_split_parts(const char *first_part, split_part_t *parts)
+{
+    FILE *part_file;
+    struct stat part_stats;
+    char *path = strdup(first_part);
+    int count = 0;
+
+    while (path != NULL)
+    {
+        parts[count].path = path;
+        part_file = fopen(path, "rb");
+        if (part_file == NULL)
+        {
+            printf("%s [%s]\n", "|KO|---> Missing split ROM part:", path);
+            count++;
+            goto broken;
+        }
+        fstat(fileno(part_file), &part_stats);
+        parts[count].header = read_smd_header_from_file(part_file);
+        fclose(part_file);
+
+        if ((part_stats.st_size < SMD_HEADER_SIZE) || (smd_check_header(parts[count].header) < 0))
+        {
+            printf("%s [%s]\n", "|KO|---> Split ROM part is not in SMD format or SMD header corrupted:", path);
+            count++;
+            goto broken;
+        }
+        parts[count].blocks = smd_block_count(parts[count].header, (unsigned long)(part_stats.st_size - SMD_HEADER_SIZE));
+        // a short part would shift every following part in the image
+        if (parts[count].blocks < (unsigned long)parts[count].header.interleaved_blocks_num)
+        {
+            printf("%s [%s]\n", "|KO|---> Split ROM part is truncated:", path);
+            count++;
+            goto broken;
+        }
+        parts[count].status = 0;
+        printf("\t%s %d: %s (%lu blocks%s)\n", "Part", count + 1, path, parts[count].blocks,
+               (parts[count].header.is_split_rom != 0) ? ", split flag set" : ", last part");
+        count++;
+
+        // the last part of a set has the split flag cleared
+        if (parts[count - 1].header.is_split_rom == 0)
+            return count;
+
+        if (count == SPLIT_MAX_PARTS)
+        {
+            printf("%s\n", "|KO|---> Too many parts in split ROM set.");
+            goto broken;
+        }
+        path = next_split_part_name(path);
+        if (path == NULL)
+        {
+            printf("%s\n", "|KO|---> Cannot derive the file name of the next split ROM part.");
+            goto broken;
+        }
+    }
+
+broken:
+    while (count > 0)
+        free(parts[--count].path);
+    return -1;
+}
+
+// decode one part of the split set into its region of the image
+void *decode_split_part(void *arg)
+{
+    split_part_t *part = (split_part_t *)arg;
+    FILE *part_file = fopen(part->path, "rb");
+
+    part->status = -1;
+    if (part_file == NULL)
+        return NULL;
+    fseek(part_file, SMD_HEADER_SIZE, SEEK_SET);
+    if (decode_smd_blocks(part_file, (int)part->blocks, part->dst, NULL) == (int)part->blocks)
+        part->status = 0;
+    fclose(part_file);
+    return NULL;
+}
+
+// reassemble a split set: decode all parts concurrently into one preallocated image, write it once
+int convert_smd_split(const char *first_part, const char *bin_filename)
+{
+    split_part_t parts[SPLIT_MAX_PARTS];
+    pthread_t workers[SPLIT_MAX_PARTS];
+    int started[SPLIT_MAX_PARTS];
+    unsigned char *binary_data = NULL;
+    unsigned long total_blocks = 0;
+    size_t bin_size;
+    rom_digest_t digest;
+    FILE *bin_file;
+    int count, i, ret = -1;
+
+    printf("%s\n", "|BUSY|---> Looking for split ROM parts....");
+    count = discover_split_parts(first_part, parts);
+    if (count < 0)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        total_blocks += parts[i].blocks;
+    bin_size = total_blocks * SMD_ROM_BLOCK_SIZE;
+    if (bin_size == 0)
+    {
+        printf("%s\n", "|KO|---> Split ROM set contains no data blocks.");
+        goto cleanup;
+    }
+    binary_data = (unsigned char *)malloc(bin_size);
+    if (binary_data == NULL)
+    {
+        printf("%s\n", "Out Of Memory.");
+        goto cleanup;
+    }
+
+    // assign disjoint regions and decode all parts at once
+    printf("%s %d %s\n", "|OK|---> Decoding", count, "parts....");
+    printf("%s %s\n", "|INFO|---> Deinterleave kernel:", smd_select_kernel()->name);
+    parts[0].dst = binary_data;
+    for (i = 1; i < count; i++)
+        parts[i].dst = parts[i - 1].dst + (parts[i - 1].blocks * SMD_ROM_BLOCK_SIZE);
+    for (i = 0; i < count; i++)
+    {
+        started[i] = (pthread_create(&workers[i], NULL, decode_split_part, &parts[i]) == 0);
+        if (!started[i])
+            decode_split_part(&parts[i]);
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (started[i])
+            pthread_join(workers[i], NULL);
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (parts[i].status < 0)
+        {
+            printf("%s [%s]\n", "|KO|---> Read error while decoding split ROM part:", parts[i].path);
+            goto cleanup;
+        }
+    }
+    printf("%s (size: %luKB)\n", "|OK|---> Decoding DONE.", (unsigned long)(bin_size / 1024));
+
+    // SHA-1 and CRC32 are sequential, so the parts are digested in order once reassembled
+    smd_digest_init(&digest);
+    smd_digest_update(&digest, binary_data, bin_size);
+    smd_digest_final(&digest);
+
+    // decode the BIN Header
+    if (parse_bin_rom_header(binary_data, &digest) < 0)
+        goto cleanup;
+
+    if (bin_filename != NULL)
+    {
+        printf("\n%s: %s\n", "|OK|---> Opening new ROM Image File", bin_filename);
+        bin_file = fopen(bin_filename, "wb");
+        if (bin_file == NULL)
+        {
+            printf("%s (ERRNO: %d)\n", "|KO|---> convert_smd_split(): fopen() error! Cannot Open Specified file.", errno);
+            goto cleanup;
+        }
+        i = write_bin_rom_file(binary_data, bin_size, bin_file);
+        if ((fclose(bin_file) != 0) || (i < 0))
+            goto cleanup;
+    }
+    else
+    {
+        printf("\n%s\n", "|NOTICE|---> No output filename specified and decode finished. Exiting...");
+    }
+    ret = 0;
+
+cleanup:
+    if (binary_data != NULL)
+        free(binary_data);
+    for (i = 0; i < count; i++)
+        free(parts[i].path);
+    return ret;
+}
+
+// BATCH CONVERSION
+// does the file name end with the SMD extension?
+int has_smd_extension(const char *name)
+{
+    size_t name_len = strlen(name);
+    size_t ext_len = strlen(SMD_FILE_EXTENSION);
+
+    return (name_len > ext_len) && (strcasecmp(name + name_len - ext_len, SMD_FILE_EXTENSION) == 0);
+}
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// append a path to a growing array of paths
+int append_batch_path(char ***paths, int *count, int *capacity, const char *path)
+{
+    char **grown;
+
+    if (*count == *capacity)
+    {
+        *capacity = (*capacity == 0) ? 64 : (*capacity * 2);
+        grown = (char **)realloc(*paths, *capacity * sizeof(char *));
+        if (grown == NULL)
+            return -1;
+        *paths = grown;
+    }
+    (*paths)[*count] = strdup(path);
+    if ((*paths)[*count] == NULL)
+        return -1;
+    (*count)++;
+    return 0;
+}
+
+// collect the files to convert: all *.smd files in a directory,
+// or one path per line if source is a regular file (file list)
+int collect_batch_files(const char *source, char ***paths)
+{
+    struct stat source_stats;
+    struct dirent *entry;
+    DIR *dir;
+    FILE *list;
+    char path[BATCH_PATH_LEN];
+    int count = 0, capacity = 0;
+    size_t len;
+
+    *paths = NULL;
+    if (stat(source, &source_stats) < 0)
+        return -1;
+
+    if (S_ISDIR(source_stats.st_mode))
+    {
+        dir = opendir(source);
+        if (dir == NULL)
+            return -1;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (!has_smd_extension(entry->d_name))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            if ((stat(path, &source_stats) < 0) || !S_ISREG(source_stats.st_mode))
+                continue;
+            if (append_batch_path(paths, &count, &capacity, path) < 0)
+                break;
+        }
+        closedir(dir);
+        // readdir order is arbitrary
+        if (count > 0)
+            qsort(*paths, count, sizeof(char *), compare_paths);
+    }
+    else
+    {
+        list = fopen(source, "r");
+        if (list == NULL)
+            return -1;
+        while (fgets(path, sizeof(path), list) != NULL)
+        {
+            len = strlen(path);
+            while ((len > 0) && ((path[len - 1] == '\n') || (path[len - 1] == '\r')))
+                path[--len] = '\0';
+            if (len == 0)
+                continue;
+            if (append_batch_path(paths, &count, &capacity, path) < 0)
+                break;
+        }
+        fclose(list);
+    }
+
+    return count;
+}
+
+// build <out_dir>/<rom name>.bin
+char *batch_output_path(const char *out_dir, const char *smd_path)
+{
+    const char *base = strrchr(smd_path, '/');
+    char *out_path = (char *)malloc(BATCH_PATH_LEN);
+    char *ext;
+
+    if (out_path == NULL)
+        return NULL;
+    base = (base == NULL) ? smd_path : base + 1;
+    snprintf(out_path, BATCH_PATH_LEN, "%s/%s", out_dir, base);
+    ext = strrchr(out_path + strlen(out_dir) + 1, '.');
+    if (ext != NULL)
+        *ext = '\0';
+    strncat(out_path, BIN_FILE_EXTENSION, BATCH_PATH_LEN - strlen(out_path) - 1);
+    return out_path;
+}
+
+// convert a single file of the batch. uses no global state.
+void convert_batch_job(batch_job_t *job)
+{
+    FILE *smd_file, *bin_file;
+    struct stat smd_stats;
+    smd_header_t job_header;
+    unsigned char *binary_data = NULL;
+    size_t bin_size;
+    int len;
+
+    job->status = -1;
+    smd_file = fopen(job->smd_path, "rb");
+    if (smd_file == NULL)
+    {
+        job->message = "cannot open file";
+        return;
+    }
+    if ((fstat(fileno(smd_file), &smd_stats) < 0) || (smd_stats.st_size < SMD_HEADER_SIZE))
+    {
+        job->message = "file too short";
+        goto cleanup;
+    }
+
+    job_header = read_smd_header_from_file(smd_file);
+    if (smd_check_header(job_header) < 0)
+    {
+        job->message = "not in SMD format or SMD header corrupted";
+        goto cleanup;
+    }
+    job->blocks = smd_block_count(job_header, (unsigned long)(smd_stats.st_size - SMD_HEADER_SIZE));
+    if (job->blocks < (unsigned long)job_header.interleaved_blocks_num)
+    {
+        job->message = "SMD file is truncated";
+        goto cleanup;
+    }
+    if (job->blocks == 0)
+    {
+        job->message = "no data blocks";
+        goto cleanup;
+    }
+
+    bin_size = job->blocks * SMD_ROM_BLOCK_SIZE;
+    binary_data = (unsigned char *)malloc(bin_size);
+    if (binary_data == NULL)
+    {
+        job->message = "out of memory";
+        goto cleanup;
+    }
+    fseek(smd_file, SMD_HEADER_SIZE, SEEK_SET);
+    smd_digest_init(&job->digest);
+    if (decode_smd_blocks(smd_file, (int)job->blocks, binary_data, &job->digest) != (int)job->blocks)
+    {
+        job->message = "read error";
+        goto cleanup;
+    }
+    smd_digest_final(&job->digest);
+    job->stored_checksum = smd_stored_checksum(binary_data);
+
+    // keep the title for the summary
+    memcpy(job->software_name, binary_data + BIN_SOFTWARE_TITLE_DOMESTIC, SWNAME_STR_LEN);
+    job->software_name[SWNAME_STR_LEN] = '\0';
+    for (len = SWNAME_STR_LEN - 1; (len >= 0) && ((job->software_name[len] == ' ') || (job->software_name[len] == '\0')); len--)
+        job->software_name[len] = '\0';
+
+    if (job->bin_path != NULL)
+    {
+        bin_file = fopen(job->bin_path, "wb");
+        if (bin_file == NULL)
+        {
+            job->message = "cannot create output file";
+            goto cleanup;
+        }
+        len = (int)fwrite(binary_data, bin_size, 1, bin_file);
+        if ((fclose(bin_file) != 0) || (len != 1))
+        {
+            job->message = "write error";
+            goto cleanup;
+        }
+    }
+    job->status = 0;
+
+cleanup:
+    if (binary_data != NULL)
+        free(binary_data);
+    fclose(smd_file);
+}
+
+// worker thread: take jobs from the shared queue until it is empty
+void *batch_worker(void *arg)
+{
+    batch_queue_t *queue = (batch_queue_t *)arg;
+    int job;
+
+    while ((job = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count)
+        convert_batch_job(&queue->jobs[job]);
+
+    return NULL;
+}
+
+// convert a whole collection using a pool of worker threads
+int convert_smd_batch(const char *source, const char *out_dir, int threads)
+{
+    pthread_t workers[BATCH_MAX_THREADS];
+    batch_queue_t queue;
+    struct timespec start, stop;
+    char **paths = NULL;
+    int count, i, started, failed = 0;
+
+    count = collect_batch_files(source, &paths);
+    if (count <= 0)
+    {
+        printf("%s [%s]\n", "|KO|---> convert_smd_batch(): No SMD files found in", source);
+        return -1;
+    }
+
+    queue.jobs = (batch_job_t *)calloc(count, sizeof(batch_job_t));
+    if (queue.jobs == NULL)
+    {
+        printf("%s\n", "Out Of Memory.");
+        return -1;
+    }
+    queue.count = count;
+    queue.next = 0;
+    for (i = 0; i < count; i++)
+    {
+        queue.jobs[i].smd_path = paths[i];
+        queue.jobs[i].bin_path = (out_dir != NULL) ? batch_output_path(out_dir, paths[i]) : NULL;
+        queue.jobs[i].message = "";
+    }
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > BATCH_MAX_THREADS)
+        threads = BATCH_MAX_THREADS;
+    if (threads > count)
+        threads = count;
+    if (threads <= 0)
+        threads = 1;
+
+    // the kernel is selected once, before the workers start
+    printf("%s %d %s %d %s\n", "|OK|---> Converting", count, "files using", threads, "worker threads....");
+    printf("%s %s\n", "|INFO|---> Deinterleave kernel:", smd_select_kernel()->name);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (started = 0; started < threads; started++)
+    {
+        if (pthread_create(&workers[started], NULL, batch_worker, &queue) != 0)
+            break;
+    }
+    // no threads at all: work on the main thread
+    if (started == 0)
+        batch_worker(&queue);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    // per-file summary
+    printf("\n%s\n", "|INFO|---> Batch Summary:");
+    for (i = 0; i < count; i++)
+    {
+        if (queue.jobs[i].status == 0)
+        {
+            printf("\t%s %5luKB  %08X  %s  [%s]%s\n", "|OK|", (queue.jobs[i].blocks * SMD_ROM_BLOCK_SIZE) / 1024, queue.jobs[i].digest.crc32,
+                   queue.jobs[i].smd_path, queue.jobs[i].software_name, (queue.jobs[i].stored_checksum != queue.jobs[i].digest.checksum) ? " (checksum mismatch)" : "");
+        }
+        else
+        {
+            printf("\t%s %7s  %8s  %s  (%s)\n", "|KO|", "-", "-", queue.jobs[i].smd_path, queue.jobs[i].message);
+            failed++;
+        }
+        free(queue.jobs[i].smd_path);
+        if (queue.jobs[i].bin_path != NULL)
+            free(queue.jobs[i].bin_path);
+    }
+    printf("\n%s %d %s %d %s (%.2fs)\n", "|OK|---> Batch DONE:", count - failed, "converted,", failed, "failed",
+           (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) / 1e9);
+
+    free(queue.jobs);
+    free(paths);
+    return (failed == 0) ? 0 : -1;
+}
+
 // Main function
 #ifdef GNUC
 void main(int argc, char **argv)
@@ -243,9 +1316,6 @@ void main(int argc, char **argv)
 int main(int argc, char **argv)
 #endif
 {
-    // START!
-    pretty_banner();
-
     // sanity check
     if (argc < 2) 
     {
@@ -254,10 +1324,38 @@ int main(int argc, char **argv)
     }
 
     // parse command line
-    while ((option = getopt(argc, argv, "c:o:")) != -1)
+    while ((option = getopt(argc, argv, "b:c:f:j:o:emstDS")) != -1)
     {
         switch (option)
         {
+            case 'S':
+                use_split = 1;
+                break;
+            case 'e':
+                use_encode = 1;
+                break;
+            case 'D':
+                use_detect = 1;
+                break;
+            case 'b':
+                batch_source = optarg;
+                break;
+            case 'j':
+                batch_threads = atoi(optarg);
+                break;
+            case 'm':
+                use_mmap = 1;
+                break;
+            case 'f':
+                layout_name = optarg;
+                use_mmap = 1;
+                break;
+            case 's':
+                use_stream = 1;
+                break;
+            case 't':
+                exit((run_deinterleave_selftest() == 0) ? 0 : -1);
+                break;
             case 'c':
                 filename = optarg;
                 break;
@@ -271,8 +1369,70 @@ int main(int argc, char **argv)
     }
 
     // ok, option parsed.
+    // detection output is meant for scripts: one line per file, no banner
+    if (use_detect)
+        exit(detect_formats(argc - optind, argv + optind));
+
+    if (batch_source != NULL)
+    {
+        pretty_banner();
+        option = convert_smd_batch(batch_source, output_filename, batch_threads);
+        printf("\n%s\n", "BYE");
+        exit((option == 0) ? 0 : -1);
+    }
+    if (filename == NULL)
+    {
+        printf("%s", "|KO|---> No ROM File specified\n");
+        usage(argv[0]);
+    }
+    // reading or writing stdin/stdout implies streaming mode
+    if ((strcmp(filename, "-") == 0) || ((output_filename != NULL) && (strcmp(output_filename, "-") == 0)))
+        use_stream = 1;
+
+    // when the ROM goes to stdout, log messages are moved to stderr
+    if ((use_stream || use_encode) && (output_filename != NULL) && (strcmp(output_filename, "-") == 0))
+        stdout_data_fd = detach_stdout_for_data();
+
+    // START!
+    pretty_banner();
+
     // begin action
     printf ("%s: %s\n", "|OK|---> Operating on ROM File", filename);
+    if (use_encode)
+    {
+        option = convert_bin_to_smd(filename, output_filename);
+        printf("\n%s\n", "BYE");
+        exit((option == 0) ? 0 : -1);
+    }
+    if (use_split)
+    {
+        option = convert_smd_split(filename, output_filename);
+        printf("\n%s\n", "BYE");
+        exit((option == 0) ? 0 : -1);
+    }
+    if (use_stream)
+    {
+        option = convert_smd_stream(filename, output_filename);
+        printf("\n%s\n", "BYE");
+        exit((option == 0) ? 0 : -1);
+    }
+    if (use_mmap)
+    {
+        if (layout_name == NULL)
+            option = convert_smd_mmap(filename, output_filename, smd_find_layout("smd"));
+        else if (strcmp(layout_name, "auto") == 0)
+            option = convert_smd_mmap(filename, output_filename, NULL);
+        else if (smd_find_layout(layout_name) != NULL)
+            option = convert_smd_mmap(filename, output_filename, smd_find_layout(layout_name));
+        else
+        {
+            printf("%s: %s\n", "|KO|---> Unknown copier layout", layout_name);
+            option = -1;
+        }
+        printf("\n%s\n", "BYE");
+        exit((option == 0) ? 0 : -1);
+    }
+
     SMD_ROM_FILE = fopen(filename, "r");
     if (SMD_ROM_FILE == NULL)
     {
@@ -288,12 +1448,14 @@ int main(int argc, char **argv)
         fclose(SMD_ROM_FILE);
         exit(-1);
     }
+    if (header.is_split_rom != 0)
+        printf("%s\n\n", "|NOTICE|---> This is the first part of a split ROM set: use -S to reassemble the whole set.");
 
     // begin decoding SMD data...
-    bin_data = deinterleave_data_blocks(SMD_ROM_FILE, header);
+    bin_data = deinterleave_data_blocks(SMD_ROM_FILE, header, &rom_digest);
 
     // decode the BIN Header
-    if (parse_bin_rom_header(bin_data) < 0)
+    if (parse_bin_rom_header(bin_data, &rom_digest) < 0)
     {
         printf("%s\n", "|KO|---> Aborting....");
         goto end;
@@ -319,7 +1481,7 @@ int main(int argc, char **argv)
         }
         else
         {
-            write_bin_rom_file(bin_data, BIN_ROM_FILE);
+            write_bin_rom_file(bin_data, header.binary_size, BIN_ROM_FILE);
             fclose(BIN_ROM_FILE);
         }
     }